@@ -16,6 +16,16 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <zlib.h>
+#ifdef LEAF_ZSTD
+#include <zstd.h>
+#endif
 
 /*** defines ***/
 
@@ -26,6 +36,36 @@
 #define LEAF_QUIT_TIMES 2
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
+#define SEARCH_IGNORE_CASE (1<<0)
+#define SEARCH_WHOLE_WORD (1<<1)
+#define LEAF_TRIGRAM_BUCKETS (1<<16)          // trigrams are hashed into this many posting lists, collisions only cost a extra verification
+#define LEAF_TRIGRAM_MIN_BYTES (1<<20)        // smaller files are scanned linearly, it is fast enough and saves the memory
+#define LEAF_GAP_MIN 64                       // the smallest gap we open in a row that is being typed into
+#define LEAF_INPUT_RING 4096                  // bytes of terminal input read at once, a power of two
+#define LEAF_INPUT_IDLE_MS 100                // without a key for this long the editor is idle
+#define LEAF_ESC_TIMEOUT_MS 50                // a ESC not followed by more input within this time is the ESC key
+#define LEAF_HEADLESS_ROWS 24                 // the screen headless mode pretends to have
+#define LEAF_HEADLESS_COLS 80
+#define LEAF_LATENCY_BUCKETS 608              // latency histogram buckets, enough for 2^40 microseconds
+#define LEAF_TRACE_EVENTS (1<<18)             // the trace ring keeps this many of the latest events
+#define LEAF_LARGE_FILE_BYTES (64LL<<20)      // files at least this big are opened as a rope, as if --rope was given
+#define LEAF_SEARCH_CHUNK (1<<20)             // a search in a rope reads the text in chunks of this many bytes
+#define LEAF_IDLE_SLICE_MS 8                  // how long a piece of background work may run before we look at the keyboard again
+#define LEAF_SLAB_CLASSES 28                  // classes 16, 32 .. 128, then 4 per power of two up to 4096 come from the arena
+#define LEAF_ARENA_CHUNK (1<<20)              // the row allocator carves its blocks from chunks of this size
+#define LEAF_UNDO_MAX (64<<20)                // bytes of undo history we keep, the oldest edits are forgotten past this
+#define LEAF_UNDO_SIDECAR ".leaf-undo"        // the undo history of a file is kept next to it, in a file with this suffix
+#define LEAF_FNV_SEED 14695981039346656037ULL // FNV-1a, used to recognize the file an undo sidecar belongs to
+#define LEAF_JOURNAL_SUFFIX ".leaf-swap"      // unsaved edits are journaled next to the file, in a file with this suffix
+#define LEAF_JOURNAL_SYNC_MS 1000             // the journal is fsync()ed at most this often, and only while the editor is idle
+#define LEAF_JOURNAL_FLUSH (64<<10)           // journal bytes buffered in memory before they are written out anyway
+#define LEAF_UNDO_COALESCE 32                 // consecutive typing is merged into one undo record up to this many bytes
+#define LEAF_FOLLOW_CHUNK (1<<20)             // follow mode reads what a file grew by in pieces of this size
+#define LEAF_FOLLOW_EVENTS ( IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF ) // what wakes follow mode up
+#define LEAF_RELOAD_MAX_DIFF 2048             // a reload diffs the lines up to this many differences, beyond that it replaces them all
+#define LEAF_COMPRESS_CHUNK (1<<17)           // a zstd file is read and written in pieces of this size
+#define LEAF_ZSTD_LEVEL 3                     // the level zstd files are saved with, its default
+#define LEAF_ROPE_WINDOW 1024                 // rows materialized at once from a rope, a few screens above and below the cursor
 
 enum editorKey{
     BACKSPACE = 127,    
@@ -40,6 +80,19 @@ enum editorKey{
     PAGE_DOWN
 };
 
+enum undoType{
+    UNDO_INSERT_TEXT = 1,
+    UNDO_DELETE_TEXT,
+    UNDO_INSERT_ROW,
+    UNDO_DELETE_ROW
+};
+
+enum fileCompression{
+    COMPRESSION_NONE = 0,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD
+};
+
 enum editorHighlight {
     HL_NORMAL = 0,
     HL_COMMENT,
@@ -62,16 +115,237 @@ struct syntax{
     char* multiline_comment_end; // in c is */
     int flags; // flags is a bit field that will contain flags for whether to highlight numbers and whether to highlight strings for that filetype
 };
+struct tabStop{
+    int at;         // offset of the tab in chars
+    int render_end; // the render column right after the tab ( always a tab stop )
+};
+
 typedef struct textRow{
-    int size;
-    int idx; // each row knows its index in the whole file
-    int in_multiline_open_comment; // boolean flag
-    int rsize; // the render size used for tabs or other non printable characters
+    /*
+    Only what the loops over many rows ( drawing, searching, highlighting ) need is kept here, 40 bytes per row with
+    the pointers first and the small fields packed at the end. The tab table lives in configuration.tab_cache and the
+    uid used by the search index in configuration.trigram.row_uid, most rows never need either of them.
+    */
     char* chars;
-    char* render;
+    char* render;  // render and highlight share one block, see rowCellsFit()
     unsigned char* highlight;  // each value from this array will correspond to a character in render
+    int size;
+    int rsize; // the render size used for tabs or other non printable characters
+    int idx; // each row knows its index in the whole file
+    unsigned char in_multiline_open_comment; // boolean flag
+    unsigned char chars_class; // the size classes of the two blocks, they come from the row allocator ( see rowBufAlloc() )
+    unsigned char render_class;
 }textRow;
 
+struct tabCache{
+    int row;    // the row the table describes, -1 when it describes none
+    int count;  // how many tabs the row has
+    int capacity;
+    struct tabStop* tabs; // the tabs of chars and where they end in render
+};
+
+struct lineOffsets{
+    long long* start; // start[i] is the byte offset of row i in the file as it would be saved ( one newline per row )
+    int valid;        // the rows below valid have the right offset, an edit of a row lowers it to that row
+    int capacity;
+};
+
+struct trigramPosting{
+    unsigned int* uids; // uids of the rows which contain a trigram hashed into this bucket ( may contain stale or repeated entries )
+    int len;
+    int capacity;
+};
+
+struct trigramIndex{
+    int enabled;        // the index is only kept for big files
+    int ready;          // set once the background build reached the last row, before that we search linearly
+    int build_row;      // the next row the background build will index
+    unsigned int next_uid;
+    int* uid_to_row;    // the current index of every row uid, -1 once the row was deleted
+    unsigned int uid_capacity;
+    unsigned int* row_uid; // the uid of every row, the other direction
+    int row_uid_capacity;
+    long entries;       // postings stored in all the buckets
+    long entries_after_build;
+    struct trigramPosting* buckets;
+};
+
+struct gapBuffer{
+    int row;    // the row whose chars currently contain the gap, -1 if every row is a flat string
+    int start;  // the gap is chars[start .. start + len), the text after it was pushed to the end of the allocation
+    int len;
+};
+
+struct undoLog{
+    char* log;          // the records, see the Undo section
+    int used;
+    int capacity;
+    int pos;            // the records in front of pos are done, the ones after it can be redone
+    long long base;     // bytes dropped from the front of the log, base + pos is a position that never moves
+    long long saved;    // base + pos when the file was last saved, -1 if that state can't be reached anymore
+    int last;           // offset of the record new typing may be merged into, -1 if none
+    int key;            // counts the keys the editor processed
+    int last_key;       // the key that wrote the last record
+    int new_group;      // the next record starts a new undo step
+    int replaying;      // set while undo or redo apply records, so they aren't recorded again
+    long long synced;   // base + the bytes of the log that are already in the sidecar file, -1 if the sidecar must be rewritten
+    long long sidecar_bytes;
+};
+
+struct journal{
+    int fd;             // -1 while there is no journal ( no file name yet )
+    char* buffer;       // records not written yet
+    int pending;
+    int capacity;
+    int unsynced;       // written but not fsync()ed
+    long long synced_at;
+    int off;            // leaf --memory and --headless aren't real editing sessions, they must not touch a journal
+};
+
+struct rowArena{
+    char* chunk;        // the chunk new blocks are carved from
+    int used;           // bytes of chunk already handed out
+    long long chunks;   // chunks allocated so far
+    long long big_bytes; // bytes of the blocks too big for the arena, they are malloc()ed one by one
+    void* free_list[LEAF_SLAB_CLASSES]; // freed blocks of every class, linked through their first bytes
+};
+
+struct inputRing{
+    unsigned char data[LEAF_INPUT_RING];
+    unsigned int head;  // head and tail only grow, the byte at position p is data[p % LEAF_INPUT_RING]
+    unsigned int tail;
+};
+
+enum headlessEventKind{
+    HEADLESS_PHASE = 1,
+    HEADLESS_IDLE,
+    HEADLESS_MEMORY
+};
+
+struct headlessEvent{
+    int kind;
+    char name[32];
+    long long at;           // the event happens when the keys in front of this offset are used up
+    long long start_us;     // the rest is measured for phases
+    long long us;
+    long long keys;
+    long long frames;
+    long long screen_bytes;
+};
+
+struct headlessScript{
+    int on;
+    char* keys;             // all the keys of the script, one after the other
+    long long len;
+    long long pos;
+    struct headlessEvent* events;
+    int event_count;
+    int next;               // the next event to happen
+    int phase;              // the event of the phase being measured, -1 before the first one
+    char* sink;             // the last frame
+    size_t sink_capacity;
+    long long frames;
+    long long screen_bytes;
+};
+
+enum latencyStage{
+    LATENCY_TOTAL = 0,
+    LATENCY_EDIT,
+    LATENCY_HIGHLIGHT,
+    LATENCY_FRAME,
+    LATENCY_WRITE,
+    LATENCY_STAGES
+};
+
+struct latencyHistogram{
+    unsigned int counts[LEAF_LATENCY_BUCKETS];
+    long long count;
+    long long max;          // in microseconds, like everything here
+};
+
+struct latencyStats{
+    struct latencyHistogram stage[LATENCY_STAGES];
+    long long key_us;       // when the key being handled was read, 0 if the next frame isn't for a key
+    long long highlight_us; // time in highlightRow() since the last frame
+    int shown;              // the stage Ctrl-P shows next
+};
+
+struct traceEvent{
+    const char* name;
+    long long start;        // microseconds
+    long long duration;
+};
+
+struct traceRing{
+    int on;
+    char* path;             // where the JSON goes
+    struct traceEvent* events;
+    unsigned long long head; // events ever recorded, the next one goes to head % LEAF_TRACE_EVENTS
+    long long origin;       // the time tracing started, the JSON counts from there
+};
+
+enum memoryKind{
+    MEMORY_ROW_STRUCTS = 0,
+    MEMORY_CHARS,
+    MEMORY_CELLS,
+    MEMORY_ARENA_SLACK,     // arena bytes no row uses: freed blocks and the unused end of chunks
+    MEMORY_UNDO,
+    MEMORY_JOURNAL,
+    MEMORY_INDEX,
+    MEMORY_ROPE,
+    MEMORY_CACHES,
+    MEMORY_FRAME,
+    MEMORY_INSTRUMENTATION,
+    MEMORY_KINDS
+};
+
+struct memoryUsage{
+    long long bytes[MEMORY_KINDS];
+    long long total;
+    long long mapped;       // the file mapped by a rope, it is page cache and not heap
+};
+
+struct fileLoader{
+    FILE* fp;               // the file being read, NULL once it is loaded
+    char* line;
+    size_t capacity;
+    long long bytes;        // read so far, and the size of the file
+    long long size;
+    unsigned long long hash; // of the whole file, newlines included, to find its undo history
+    long long shown_at;     // when idle loading last redrew the screen
+    int failed;             // reading stopped at a error ( a truncated .gz ), the rows are not the whole file
+};
+
+struct follow{
+    int fd;                 // the inotify descriptor, -1 if the file isn't watched ( no terminal, or no file )
+    int watch;              // the watch on the file, -1 when it went away
+    int on;                 // following the file, otherwise a change is only reported
+    ino_t inode;            // the file as it was loaded or last saved
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    int external;           // someone else changed the file since
+    long long offset;       // bytes of the file the document already has
+    int open_line;          // the last line had no newline yet, the next bytes continue its row
+    int changed;            // inotify said the file changed, editorIdle() reads it
+    int appending;          // set while appended text goes in, it is not a edit
+    int keep;               // --keep: rows kept while following, 0 keeps them all
+    long long dropped;      // rows dropped from the head so far
+};
+
+struct compressedFile{
+    int compression;
+    gzFile gz;
+#ifdef LEAF_ZSTD
+    FILE* raw;              // the compressed file
+    char* buffer;           // LEAF_COMPRESS_CHUNK compressed bytes on their way
+    ZSTD_inBuffer in;       // what was read of it and not decompressed yet
+    size_t left;            // not 0 while a frame is not finished
+    ZSTD_DCtx* dctx;
+    ZSTD_CCtx* cctx;
+#endif
+};
+
 struct editorConfig{
     int screenrows, screencols;
     int row_offset; // keeps track of what rows are currently being shown
@@ -82,10 +356,30 @@ struct editorConfig{
     int dirty;      // this is a flag which tells whether the file has unsaved modifications
     textRow* row;
     char* filename;
+    int compression; // how the file is stored on disk, COMPRESSION_NONE for plain text
     char statusmsg[80]; // these two are for the status message 
     time_t statusmsg_time;
     struct termios original_termios;                            // Original terminal state
     struct syntax* syntax;
+    struct trigramIndex trigram;
+    struct gapBuffer gap;
+    struct tabCache tab_cache; // the tab table of the one row whose columns were converted last
+    struct lineOffsets line_offsets; // for going to a byte offset in row mode, a rope has its own byte counts
+    struct undoLog undo;
+    struct journal journal;
+    struct inputRing input;
+    struct headlessScript headless;
+    struct latencyStats latency;
+    struct traceRing trace;
+    struct fileLoader loader;
+    struct follow follow;
+    int frame_bytes; // size of the last frame refreshScreen() built
+    int key_waiting; // the last key was already waiting when we read it, so it was pasted or typed ahead
+    int search_flags; // SEARCH_IGNORE_CASE and SEARCH_WHOLE_WORD, toggled from the search prompt
+    struct rowArena arena; // where the chars, render and highlight buffers of the rows come from
+    struct rope* rope; // the document if the file was opened with --rope, NULL when the rows are the whole document
+    int win_first;  // row holds the rows win_first .. win_first + win_rows - 1, in row mode that is every row of the file
+    int win_rows;
 }configuration;
 
 /*** Filetypes ***/
@@ -119,6 +413,37 @@ struct syntax HLDB[] = {    // HLDB = highlight database
 void setStatusMessage(const char* format, ... ); // otherwise we wouldn't be able to compile the save to file function because we used there a function before it was defined
 void refreshScreen();
 char* prompt( char* prompt, void (*callback)(char* , int) );
+char* promptWith( char* prompt, void (*callback)(char* , int), int allow_empty );
+int editorIdlePending();
+void editorIdle();
+void loadRows(long long deadline);
+void loadRest();
+textRow* editorRow(int at);
+textRow* editorRowIfLoaded(int at);
+void ropeRowEdit(textRow* row, int at, int deleted, const char* text, int inserted);
+void ropeRowInserted(int at, const char* s, size_t len);
+void ropeRowDeleted(int at);
+void undoRecordEdit(int type, int row, int col, const char* text, int len);
+void lineOffsetsChanged(int row);
+void followEvents();
+void followRead(long long deadline);
+void followWatch();
+void followMark(long long bytes);
+void externalCheck();
+void undoForget();
+void trigramRowsDropped(int count);
+void clampCursorX();
+void journalAppend(int type, int row, int col, const char* text, int len);
+void journalFlush();
+void journalTick();
+void rowInsertText(textRow* row, int at, const char* s, int len);
+void rowDeleteText(textRow* row, int at, int len);
+int headlessFill(unsigned char* to, unsigned int space);
+long long monotonicUs();
+void latencyRecord(int stage, long long us);
+long long traceBegin();
+void memoryReport();
+void traceEnd(const char* name, long long start);
 
 /*** Terminal ***/
 
@@ -126,6 +451,7 @@ void die( const char* s)                                        // function used
 {
     write(STDOUT_FILENO, "\x1b[2J", 4);                         // This function is used to clear the screen when we exit. The 2J argument clears the whole screen.
     write(STDOUT_FILENO, "\x1b[H", 3);
+    journalFlush(); // often the terminal is gone ( read() fails ), the edits aren't
     perror(s);
     exit(1);
 }
@@ -172,63 +498,133 @@ void enableRawMode()
     //With this part, we no longer see on the screen the keys we pressed
 }
 
+/*
+Input goes through a ring buffer. One read() takes everything the terminal has ( a whole escape sequence, a whole paste ) and
+the keys are parsed out of the ring, so a arrow key costs one syscall instead of three and a pasted block a few per KB.
+A lone ESC and the start of a escape sequence look the same, so after a ESC i wait up to LEAF_ESC_TIMEOUT_MS for the rest:
+a terminal sends a sequence in one go, a human doesn't type that fast.
+*/
+
+int inputFill(int timeout_ms)
+{
+    /* waits up to timeout_ms ( -1 = forever ) for input and reads as much of it as fits, returns the bytes read */
+    struct inputRing* input = &configuration.input;
+    unsigned int at = input->tail % LEAF_INPUT_RING;
+    unsigned int space = LEAF_INPUT_RING - ( input->tail - input->head );
+    if( space > LEAF_INPUT_RING - at ) // only up to the end of the array, the rest comes with the next read
+        space = LEAF_INPUT_RING - at;
+    if( space == 0 )
+        return 0;
+    if( configuration.headless.on ) // the keys come from a script
+    {
+        int count = headlessFill(&input->data[at], space);
+        input->tail += count;
+        return count;
+    }
+    struct pollfd pfd[2] = { { STDIN_FILENO, POLLIN, 0 }, { configuration.follow.fd, POLLIN, 0 } }; // poll() skips a fd of -1
+    int ready = poll(pfd, 2, timeout_ms);
+    if( ready == -1 && errno != EINTR )
+        die("poll");
+    if( ready > 0 && ( pfd[1].revents & POLLIN ) )
+        followEvents(); // the followed file changed, we return without a key so editorIdle() gets to read it
+    if( ready <= 0 || !( pfd[0].revents & POLLIN ) )
+        return 0;
+    ssize_t nread = read(STDIN_FILENO, &input->data[at], space);
+    if( nread == -1 && errno != EAGAIN && errno != EINTR )
+        die("read");
+    if( nread <= 0 )
+        return 0;
+    input->tail += nread;
+    return nread;
+}
+
+int inputPeek(int timeout_ms)
+{
+    /* the next byte without taking it, -1 if none came within timeout_ms */
+    struct inputRing* input = &configuration.input;
+    if( input->head == input->tail && inputFill(timeout_ms) == 0 )
+        return -1;
+    return input->data[input->head % LEAF_INPUT_RING];
+}
+
+int inputByte(int timeout_ms)
+{
+    int c = inputPeek(timeout_ms);
+    if( c != -1 )
+        configuration.input.head ++;
+    return c;
+}
+
 int editorReadKey()
 {
     //function used to read characters. It waits for a keypress and than it returns it.
-    int nread;
-    char char_read;
-    while( (nread = read(STDIN_FILENO, &char_read, 1)) != 1 )
+    struct inputRing* input = &configuration.input;
+    configuration.key_waiting = ( input->head != input->tail ); // read together with the key before it, so typed ahead or pasted
+    while( input->head == input->tail )
     {
-        if( nread == -1 && errno != EAGAIN )
-            die("read");
+        if( editorIdlePending() )
+        {
+            /*
+            While there is background work (like building the search index) we don't want to sleep waiting for a key.
+            I look at the keyboard without waiting and only if nothing was typed i run one short slice of work.
+            */
+            if( inputFill(0) == 0 )
+                editorIdle();
+            continue;
+        }
+        if( inputFill(LEAF_INPUT_IDLE_MS) == 0 ) // nothing was typed for a while
+            editorIdle();
     }
-    
+    char char_read = inputByte(0);
+    configuration.latency.key_us = monotonicUs(); // the key to screen time starts now
+
     if( char_read == '\x1b' )                   // Pressing an arrow key sends multiple bytes as input to our program. These bytes are in the form of an escape sequence that starts with '\x1b', '[', followed by an 'A', 'B', 'C', or 'D' depending on which of the four arrow keys was pressed.
     {
-        char seq[3];   
-        if( read(STDIN_FILENO, &seq[0], 1) != 1 )
-            return '\x1b';
-        if( read(STDIN_FILENO, &seq[1], 1) != 1)
-            return '\x1b';
-        if( seq[0] == '[' )
+        int kind = inputPeek(LEAF_ESC_TIMEOUT_MS);
+        if( kind != '[' && kind != 'O' )
+            return '\x1b'; // a ESC on its own, whatever follows it is the next key
+        inputByte(0);
+        /*
+        A sequence is ESC [ ( or ESC O ), some parameter bytes ( digits and ';' ) and one final byte from '@' to '~'. I read it
+        whole even when i don't know it, so the rest of a unknown sequence isn't taken for typed text.
+        */
+        char params[16];
+        int len = 0;
+        int final;
+        while( 1 )
         {
-            if( seq[1] >= '0' && seq[1] <= '9' )
-            {
-                if( read(STDIN_FILENO, &seq[2], 1) != 1)
-                    return '\x1b';
-                if( seq[2] == '~')
-                {
-                    switch(seq[1])
-                    {
-                        case '1': return HOME_KEY; // The home key escape sequence is <esc>[1~ or <esc>[7~
-                        case '3': return DEL_KEY; // The delete escape sequence is <esc>[3~
-                        case '4': return END_KEY; // The end key escape sequence is <esc>[4~, <esc>[8~
-                        case '5': return PAGE_UP; //The page up escape sequence is <esc>[5~
-                        case '6': return PAGE_DOWN; // The page down escape sequence is <esc>[6~
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
-                    }
-                }
-            }
-            else
+            final = inputByte(LEAF_ESC_TIMEOUT_MS);
+            if( final == -1 )
+                return '\x1b';
+            if( final >= 0x40 && final <= 0x7e )
+                break;
+            if( len < (int)sizeof(params) - 1 )
+                params[len ++] = final;
+        }
+        params[len] = '\0';
+        if( kind == '[' && final == '~' && len == 1 )
+        {
+            switch(params[0])
             {
-                switch(seq[1])
-                {
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                    case 'H': return HOME_KEY; //The home key escape sequence is <esc>[H
-                    case 'F': return END_KEY; //The end key escape sequence is <esc>[F
-                }
+                case '1': return HOME_KEY; // The home key escape sequence is <esc>[1~ or <esc>[7~
+                case '3': return DEL_KEY; // The delete escape sequence is <esc>[3~
+                case '4': return END_KEY; // The end key escape sequence is <esc>[4~, <esc>[8~
+                case '5': return PAGE_UP; //The page up escape sequence is <esc>[5~
+                case '6': return PAGE_DOWN; // The page down escape sequence is <esc>[6~
+                case '7': return HOME_KEY;
+                case '8': return END_KEY;
             }
         }
-        else if( seq[0] == 'O')
+        else if( len == 0 )
         {
-            switch(seq[1])
+            switch(final)
             {
-                case 'H': return HOME_KEY;//The home key escape sequence is <esc>OH
-                case 'F': return END_KEY;//The end key escape sequence is <esc>OF
+                case 'A': return ARROW_UP;
+                case 'B': return ARROW_DOWN;
+                case 'C': return ARROW_RIGHT;
+                case 'D': return ARROW_LEFT;
+                case 'H': return HOME_KEY; //The home key escape sequence is <esc>[H or <esc>OH
+                case 'F': return END_KEY; //The end key escape sequence is <esc>[F or <esc>OF
             }
         }
         return '\x1b';
@@ -238,7 +634,6 @@ int editorReadKey()
         return char_read;
     }
 }
-
 int getCursorPosition(int* rows, int* cols)
 {
     char buffer[32];
@@ -251,8 +646,10 @@ int getCursorPosition(int* rows, int* cols)
     
     while( i < sizeof(buffer) - 1 )                               // I store in the buffer the output of that escape sequence.
     {
-        if( read(STDIN_FILENO, &buffer[i], 1) != 1 )
+        int c = inputByte(LEAF_INPUT_IDLE_MS);                    // the answer comes through the same ring as the keys
+        if( c == -1 )
             break;
+        buffer[i] = c;
         if( buffer[i] == 'R' )
             break;
         i++;
@@ -286,6 +683,111 @@ int getWindowSize(int* rows, int* cols)                           // This functi
     return 0;
 }
 
+/*** Row buffers ***/
+
+/*
+Every row owns three buffers ( chars, render and highlight ). With malloc() a million line file meant three million heap
+blocks with their headers, and updateSyntax() / UpdateRowSpan() reallocated them on every change. They come from a small
+size class allocator instead:
+
+  - a request is rounded up to a class: steps of 16 bytes up to 128, then 4 classes per power of two, so at most a quarter
+    of a block is wasted. The row keeps the class of each buffer ( one byte ) and a buffer only moves when it outgrows it
+  - blocks up to LEAF_SLAB_MAX are carved one after the other from LEAF_ARENA_CHUNK sized chunks, so the rows of a file that
+    was just loaded sit next to each other, in file order, without any per block header
+  - a freed block goes on the free list of its class and the next request of that class takes it back. Chunks are never freed.
+  - bigger classes are plain malloc() blocks
+*/
+
+int slabClass(int need)
+{
+    if( need <= 128 )
+        return need <= 16 ? 0 : ( need + 15 ) / 16 - 1;
+    int base = 128, shift = 7;
+    while( base < need - base )
+    {
+        base *= 2;
+        shift ++;
+    }
+    int step = base / 4;
+    return 8 + ( shift - 7 ) * 4 + ( need - base + step - 1 ) / step - 1;
+}
+
+int rowBufSize(unsigned char cls)
+{
+    if( cls < 8 )
+        return ( cls + 1 ) * 16;
+    int base = 128 << ( ( cls - 8 ) / 4 );
+    return base + ( ( cls - 8 ) % 4 + 1 ) * ( base / 4 );
+}
+
+void* rowBufAlloc(int need, unsigned char* cls)
+{
+    *cls = slabClass(need);
+    int size = rowBufSize(*cls);
+    if( *cls >= LEAF_SLAB_CLASSES )
+    {
+        configuration.arena.big_bytes += size;
+        return malloc(size);
+    }
+    struct rowArena* arena = &configuration.arena;
+    void* block = arena->free_list[*cls];
+    if( block )
+    {
+        arena->free_list[*cls] = *(void**)block;
+        return block;
+    }
+    if( arena->chunk == NULL || arena->used + size > LEAF_ARENA_CHUNK )
+    {
+        arena->chunk = malloc(LEAF_ARENA_CHUNK); // the few bytes left at the end of the old chunk are simply lost
+        arena->used = 0;
+        arena->chunks ++;
+    }
+    block = arena->chunk + arena->used;
+    arena->used += size;
+    return block;
+}
+
+void rowBufFree(void* block, unsigned char cls)
+{
+    if( block == NULL )
+        return;
+    if( cls >= LEAF_SLAB_CLASSES )
+    {
+        configuration.arena.big_bytes -= rowBufSize(cls);
+        free(block);
+        return;
+    }
+    struct rowArena* arena = &configuration.arena;
+    *(void**)block = arena->free_list[cls];
+    arena->free_list[cls] = block;
+}
+
+void* rowBufResize(void* block, unsigned char* cls, int keep, int need)
+{
+    /* a buffer of at least need bytes starting with the first keep bytes of block, growing by half so appending stays cheap */
+    if( block && need <= rowBufSize(*cls) )
+        return block;
+    int want = need;
+    if( block && want < rowBufSize(*cls) + rowBufSize(*cls) / 2 )
+        want = rowBufSize(*cls) + rowBufSize(*cls) / 2;
+    unsigned char new_cls;
+    char* grown = rowBufAlloc(want, &new_cls);
+    if( keep > 0 )
+        memcpy(grown, block, keep);
+    rowBufFree(block, *cls);
+    *cls = new_cls;
+    return grown;
+}
+
+void* rowBufFit(void* block, unsigned char* cls, int need)
+{
+    /* a buffer for need bytes whose old content doesn't matter, a block much bigger than needed is swapped for a smaller one */
+    if( block && need <= rowBufSize(*cls) && ( *cls < 4 || need >= rowBufSize(*cls) / 4 ) )
+        return block;
+    rowBufFree(block, *cls);
+    return rowBufAlloc(need, cls);
+}
+
 /*** Syntax highlight ***/
 
 int is_separator(int c)
@@ -293,17 +795,43 @@ int is_separator(int c)
     return isspace(c) || c == '\0' || strchr(",._(){}[]/+-=;*<>%", c) != NULL; // we use this function to properly delimit a number from a name which contains digits
 }
 
-void updateSyntax(textRow* row)
-{
-    row->highlight = realloc(row->highlight, row->rsize );
-    memset(row->highlight, HL_NORMAL, row->rsize);
+struct lexState{
+    int prev_sep;   // the previous character was a separator
+    int in_string;  // the quote of the string we are in, 0 outside of strings
+    int in_comment; // we are inside a multi line comment
+};
 
-    if( configuration.syntax == NULL )
-        return;
+void syntaxRowEnded(textRow* row, int in_comment);
+
+int syntaxLookahead()
+{
+    /*
+    How far the highlight of a character can depend on the characters after it: a keyword looks at the separator right after it
+    and the comment delimiters are compared as a whole. An edit can't change the highlight of anything further to its left.
+    */
+    int lookahead = 2; // an escaped character in a string
+    char** keywords = configuration.syntax->keywords;
+    for( int j = 0; keywords[j]; j ++ )
+        if( (int)strlen(keywords[j]) + 1 > lookahead )
+            lookahead = strlen(keywords[j]) + 1;
+    char* delimiters[3] = { configuration.syntax->singleline_comment_start, configuration.syntax->multiline_comment_start, configuration.syntax->multiline_comment_end };
+    for( int j = 0; j < 3; j ++ )
+        if( delimiters[j] && (int)strlen(delimiters[j]) > lookahead )
+            lookahead = strlen(delimiters[j]);
+    return lookahead;
+}
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = ( row->idx > 0 && configuration.row[row->idx - 1].in_multiline_open_comment); // used only for multi line comments
+int highlightRow(textRow* row, int i, struct lexState* state, int converge_from)
+{
+    /*
+    The lexer itself: it highlights render starting with column i in the given state. When we only re-highlight part of a row,
+    the highlight array still holds the previous colors for the rest of it, so as soon as we pass ( at or after converge_from )
+    a plain separator which was also plain before, the lexer is in the same state as last time and everything after it would
+    come out exactly as it already is. Then it stops and returns 1. It returns 0 when it reached the end of the row.
+    */
+    int prev_sep = state->prev_sep;
+    int in_string = state->in_string;
+    int in_comment = state->in_comment;
 
     char* comment_start = configuration.syntax->singleline_comment_start; // alias
     char* mcs = configuration.syntax->multiline_comment_start; // alias
@@ -315,7 +843,6 @@ void updateSyntax(textRow* row)
 
     char** keywords = configuration.syntax->keywords;   // just an alias
 
-    int i = 0;
     while( i < row->rsize )
     {
         char c = row->render[i];
@@ -374,7 +901,7 @@ void updateSyntax(textRow* row)
             if( in_string )
             {
                 row->highlight[i] = HL_STRING;
-                if( c == '\\' && i + 1 < row->size )
+                if( c == '\\' && i + 1 < row->rsize )
                 {
                     row->highlight[i+1] = HL_STRING;
                     i += 2;
@@ -433,9 +960,41 @@ void updateSyntax(textRow* row)
                 continue;
             }
         }
+        int was_plain = ( row->highlight[i] == HL_NORMAL ); // what this column had before we started
+        row->highlight[i] = HL_NORMAL;
         prev_sep = is_separator(c);
         i++;
+        if( i > converge_from && was_plain && prev_sep )
+            return 1;
     }
+    state->prev_sep = prev_sep;
+    state->in_string = in_string;
+    state->in_comment = in_comment;
+    return 0;
+}
+
+void updateSyntax(textRow* row)
+{
+    memset(row->highlight, HL_NORMAL, row->rsize); // UpdateRow() already made room for it next to the render
+
+    if( configuration.syntax == NULL )
+        return;
+
+    long long trace_start = traceBegin();
+    struct lexState state;
+    state.prev_sep = 1;
+    state.in_string = 0;
+    textRow* prev = editorRowIfLoaded(row->idx - 1); // in rope mode the row above may not be materialized, then we assume no comment
+    state.in_comment = ( prev && prev->in_multiline_open_comment); // used only for multi line comments
+    long long lex_start = monotonicUs();
+    highlightRow(row, 0, &state, row->rsize); // the whole row is lexed, it never converges
+    configuration.latency.highlight_us += monotonicUs() - lex_start;
+    syntaxRowEnded(row, state.in_comment);
+    traceEnd("updateSyntax", trace_start); // the rows a comment change propagated to are nested inside
+}
+
+void syntaxRowEnded(textRow* row, int in_comment)
+{
     int changed = (row->in_multiline_open_comment != in_comment );
     row->in_multiline_open_comment = in_comment; // tells me whether the ended as an unclosed multi-line comment or not. 
     if( changed && row->idx + 1 < configuration.rows_number )
@@ -450,7 +1009,9 @@ void updateSyntax(textRow* row)
         itself with the next line, the change will continue to propagate to more and more lines until one of them is unchanged,
         at which point i know that all the lines after that one must be unchanged as well.
         */
-        updateSyntax(&configuration.row[row->idx + 1]);
+        textRow* next = editorRowIfLoaded(row->idx + 1);
+        if( next )
+            updateSyntax(next);
     }
 }
 
@@ -495,7 +1056,7 @@ void selectSyntaxHighlight()
             {
                 configuration.syntax = syntax;
                 int filerow;
-                for( filerow = 0; filerow < configuration.rows_number; filerow ++ )
+                for( filerow = 0; filerow < configuration.win_rows; filerow ++ ) // in rope mode only the window, never the whole file
                 {
                     updateSyntax(&configuration.row[filerow]);  // to highlight when saving a new file with a specific extension
                 }
@@ -506,307 +1067,3778 @@ void selectSyntaxHighlight()
     }
 }
 
-/*** Row operations ***/
+/*** Search patterns ***/
 
-int CursorXToRenderXConverter(textRow* row, int cursorX)
+/*
+Every search goes through a compiled searchPattern. Matching is a Horspool scan where every byte goes through a fold table
+before it is compared, so a case insensitive search costs exactly as much as a case sensitive one and never needs a lowercase
+copy of the row. For case sensitive searches the fold table is simply the identity.
+*/
+
+unsigned char identity_table[256];
+unsigned char fold_table[256];
+
+void initFoldTables()
 {
-    /*I use rx % KILO_TAB_STOP to find out how many columns we are to the right of the last tab stop, 
-    and then subtract that from KILO_TAB_STOP - 1 to find out how many columns we are to the left of the next tab stop. 
-    We add that amount to rx to get just to the left of the next tab stop, and then the unconditional rx++ statement gets 
-    us right on the next tab stop*/
-    int renderX = 0;
-    for( int i = 0; i < cursorX; i ++ )
+    for( int c = 0; c < 256; c ++ )
     {
-        if( row->chars[i] == '\t' )
-        {
-            renderX += (LEAF_TAB_STOP - 1) - (renderX % LEAF_TAB_STOP);
-        }
-        renderX ++;
+        identity_table[c] = c;
+        fold_table[c] = tolower(c);
     }
-    return renderX;
 }
 
-int RederXToCursorXConverter( textRow* row, int renderX )
+struct searchPattern{
+    const char* query;
+    int len;
+    int flags;
+    const unsigned char* fold;
+    int shift[256]; // how far the window can jump, indexed by the folded last byte of the window
+};
+
+void compilePattern(struct searchPattern* pattern, const char* query, int flags)
 {
-    /*
-    I loop through the chars string, calculating the current rx value (current_renderX) as we go. But instead of stopping when I hit a particular 
-    cursorX value and returning current_renderX, i want to stop when current_renderX hits the given renderX value and return cursorX.
+    pattern->query = query;
+    pattern->len = strlen(query);
+    pattern->flags = flags;
+    pattern->fold = ( flags & SEARCH_IGNORE_CASE ) ? fold_table : identity_table;
+    for( int c = 0; c < 256; c ++ )
+        pattern->shift[c] = pattern->len;
+    for( int i = 0; i < pattern->len - 1; i ++ )
+        pattern->shift[pattern->fold[(unsigned char)query[i]]] = pattern->len - 1 - i;
+}
 
-    The return statement at the very end is just in case the caller provided an renderX that’s out of range, which shouldn’t happen. 
-    The return statement inside the for loop should handle all renderX values that are valid indexes into render.
-    */
-    int current_renderX = 0;
-    int cursorX;
-    for( cursorX = 0; cursorX < row->size; cursorX ++ )
+int patternSearch(const struct searchPattern* pattern, const char* text, int text_len, int from)
+{
+    /* returns the offset of the first match starting at or after from, or -1 if there is none */
+    const unsigned char* fold = pattern->fold;
+    const unsigned char* query = (const unsigned char*)pattern->query;
+    const unsigned char* s = (const unsigned char*)text;
+    int len = pattern->len;
+
+    int at = from;
+    while( at + len <= text_len )
     {
-        if( row->chars[cursorX] == '\t' )
+        int i = len - 1;
+        while( i >= 0 && fold[s[at + i]] == fold[query[i]] )
+            i --;
+        if( i < 0 )
         {
-            current_renderX += ( LEAF_TAB_STOP - 1 ) - ( current_renderX % LEAF_TAB_STOP );
+            // a whole word match needs a separator ( or the line boundary ) on both sides
+            if( !( pattern->flags & SEARCH_WHOLE_WORD ) ||
+                (( at == 0 || is_separator(s[at - 1]) ) && ( at + len == text_len || is_separator(s[at + len]) )) )
+                return at;
+            at ++;
+            continue;
         }
-        current_renderX ++;
-        
-        if( current_renderX > renderX ) return cursorX;
+        at += pattern->shift[fold[s[at + len - 1]]];
     }
-    return cursorX;
+    return -1;
 }
 
-void UpdateRow(textRow* row)
+/*** Trigram index ***/
+
+/*
+For very big files even a linear strstr() over every row costs too much per keystroke while searching. The trigram index keeps,
+for every trigram (3 consecutive bytes) of the rows chars, the list of rows that contain it. A query of length >= 3 can then
+only match the rows found in the posting list of its rarest trigram, and only those rows are verified with patternSearch().
+
+ - trigrams are case folded and hashed into LEAF_TRIGRAM_BUCKETS lists. A collision only adds candidates, never removes them.
+ - rows are identified by their uid and not by their index, so inserting or deleting a row doesn't touch the postings.
+   uid_to_row translates a uid back into the current row index.
+ - when a row changes it is simply indexed again. The stale postings stay behind and are filtered by the verification,
+   and when too many of them pile up the index is rebuilt in the background.
+*/
+
+long long monotonicMs()
 {
-    int tabs = 0;
-    for( int i = 0; i < row->size; i ++ )
-        if( row->chars[i] == '\t' )
-            tabs++;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    free(row->render);
-    row->render = malloc( row->size + tabs*(LEAF_TAB_STOP - 1) + 1);
-    int idx = 0;
-    for( int i = 0; i < row->size; i ++ )
-        if( row->chars[i] == '\t' )
-        {
-            row->render[idx++] = ' ';
-            while( idx % LEAF_TAB_STOP != 0 ) row->render[idx++] = ' ';
-        }
-        else
-        {
-            row->render[idx++] = row->chars[i];
-        }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-    updateSyntax(row);
+unsigned int trigramHash(const char* s)
+{
+    unsigned int key = ((unsigned int)fold_table[(unsigned char)s[0]] << 16)
+                     | ((unsigned int)fold_table[(unsigned char)s[1]] << 8)
+                     |  (unsigned int)fold_table[(unsigned char)s[2]];
+    return ( ( key * 2654435761u ) >> 16 ) & ( LEAF_TRIGRAM_BUCKETS - 1 );
 }
 
-void insertRow(int at, char* s, size_t len)             
+void trigramTrackRows(int from)
 {
-    /*This funtion allocates a new text row in the text matrix and inserts it at the given position.*/
-    if( at < 0 || at > configuration.rows_number )
+    // keeps uid_to_row in sync when the rows from the index from on moved
+    struct trigramIndex* index = &configuration.trigram;
+    for( int i = from; i < configuration.rows_number; i ++ )
+        index->uid_to_row[index->row_uid[i]] = i;
+}
+
+void trigramReserveUid(unsigned int uid)
+{
+    struct trigramIndex* index = &configuration.trigram;
+    if( !index->enabled || uid < index->uid_capacity )
         return;
-    configuration.row = realloc(configuration.row, sizeof(textRow) * ( configuration.rows_number + 1 ) );
-    memmove(&configuration.row[at + 1], &configuration.row[at], sizeof(textRow) * (configuration.rows_number - at));
-    for( int i = at + 1; i <= configuration.rows_number; i ++ )
+    unsigned int capacity = index->uid_capacity ? index->uid_capacity : 1024;
+    while( capacity <= uid )
+        capacity *= 2;
+    index->uid_to_row = realloc(index->uid_to_row, sizeof(int) * capacity);
+    for( unsigned int i = index->uid_capacity; i < capacity; i ++ )
+        index->uid_to_row[i] = -1;
+    index->uid_capacity = capacity;
+}
+
+void trigramAddRow(textRow* row)
+{
+    struct trigramIndex* index = &configuration.trigram;
+    if( row->idx == configuration.gap.row )
+        return; // its chars are split by the gap, the row is indexed when the gap is closed
+    unsigned int uid = index->row_uid[row->idx];
+    for( int i = 0; i + 2 < row->size; i ++ )
     {
-        configuration.row[i].idx ++;
+        struct trigramPosting* posting = &index->buckets[trigramHash(&row->chars[i])];
+        if( posting->len && posting->uids[posting->len - 1] == uid )
+            continue; // the same row hit this bucket a moment ago
+        if( posting->len == posting->capacity )
+        {
+            posting->capacity = posting->capacity ? posting->capacity * 2 : 4;
+            posting->uids = realloc(posting->uids, sizeof(unsigned int) * posting->capacity);
+        }
+        posting->uids[posting->len++] = uid;
+        index->entries ++;
     }
+}
 
-    configuration.row[at].idx = at;
-    configuration.row[at].size = len;
-    configuration.row[at].chars = malloc(len + 1);
-    memcpy(configuration.row[at].chars, s, len);
-    configuration.row[at].chars[len] = '\0';
-
-    configuration.row[at].rsize = 0;                                // initializing the render size and string for the new line
-    configuration.row[at].render = NULL;
-
-    configuration.row[at].highlight = NULL;
-    configuration.row[at].in_multiline_open_comment = 0;
-    UpdateRow(&configuration.row[at]);
-
-    configuration.rows_number ++;
-    configuration.dirty ++;
-}   
-
-void rowInsertChar( textRow* row, int at, int c )
+void trigramFreeBuckets()
 {
-    if( at < 0 || at > row->size )
-        at = row->size;
-    row->chars = realloc(row->chars, row->size + 2); // we allocate two more because one is for the new char and the second is for the terminator
-    memmove(&row->chars[at + 1], &row->chars[at], row->size  - at + 1);//memmove() is used to copy a block of memory from a location to another. This first moves it into a buffer than into the new location so there is no problem with string overlap.
-    row->size ++;
-    row->chars[at] = c;
-    UpdateRow(row);
-    configuration.dirty ++;
+    struct trigramIndex* index = &configuration.trigram;
+    if( index->buckets == NULL )
+        return;
+    for( int i = 0; i < LEAF_TRIGRAM_BUCKETS; i ++ )
+        free(index->buckets[i].uids);
+    memset(index->buckets, 0, sizeof(struct trigramPosting) * LEAF_TRIGRAM_BUCKETS);
+    index->entries = 0;
 }
 
-void rowDeleteChar( textRow* row, int at)
+void trigramEnable()
 {
-    if( at < 0 || at > row->size )
-        at = row->size;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size --;
-    UpdateRow(row);
-    configuration.dirty ++;
+    /* Called once the file is loaded. The index itself is built later, in slices, while the editor waits for keys. */
+    struct trigramIndex* index = &configuration.trigram;
+    if( index->enabled )
+        return;
+    index->enabled = 1;
+    index->ready = 0;
+    index->build_row = 0;
+    if( index->buckets == NULL )
+        index->buckets = calloc(LEAF_TRIGRAM_BUCKETS, sizeof(struct trigramPosting));
+    index->row_uid_capacity = configuration.rows_number + 1;
+    index->row_uid = malloc(sizeof(unsigned int) * index->row_uid_capacity);
+    for( int i = 0; i < configuration.rows_number; i ++ )
+        index->row_uid[i] = index->next_uid ++;
+    trigramReserveUid(index->next_uid);
+    trigramTrackRows(0);
 }
 
-void freeRow(textRow* row)
+void trigramRowChanged(textRow* row)
 {
-    free(row->chars);
-    free(row->render);
-    free(row->highlight);
+    struct trigramIndex* index = &configuration.trigram;
+    if( !index->enabled || ( !index->ready && row->idx >= index->build_row ) )
+        return; // rows the build didn't reach yet will be indexed by the build itself
+    trigramAddRow(row);
+    if( index->ready && index->entries > 2 * index->entries_after_build + LEAF_TRIGRAM_BUCKETS )
+    {
+        // too many stale postings, start again from an empty index
+        trigramFreeBuckets();
+        index->ready = 0;
+        index->build_row = 0;
+    }
 }
 
-void deleteRow(int at)
+void trigramRowInserted(int at)
 {
-    if( at < 0 || at >= configuration.rows_number ) //we validate the index
+    /* called once the row at was inserted ( and counted in rows_number ), it gets a new uid */
+    struct trigramIndex* index = &configuration.trigram;
+    if( !index->enabled )
         return;
-    freeRow(&configuration.row[at]);    //free memory owned by the deleted row
-    memmove(&configuration.row[at], &configuration.row[at + 1], sizeof(textRow) * (configuration.rows_number - at - 1)); 
-    for( int i = at; i < configuration.rows_number - 1; i ++ )
+    if( index->row_uid_capacity < configuration.rows_number )
     {
-        configuration.row[i].idx --;
+        index->row_uid_capacity *= 2;
+        index->row_uid = realloc(index->row_uid, sizeof(unsigned int) * index->row_uid_capacity);
     }
-    configuration.rows_number --;//memmove() to overwrite the deleted row struct with the rest of the rows that come after it, and decrement the number of rows. 
-    configuration.dirty ++;
+    memmove(&index->row_uid[at + 1], &index->row_uid[at], sizeof(unsigned int) * ( configuration.rows_number - at - 1 ));
+    index->row_uid[at] = index->next_uid ++;
+    trigramReserveUid(index->row_uid[at]);
+    trigramTrackRows(at);
+    if( !index->ready && at < index->build_row )
+        index->build_row ++; // the build cursor keeps pointing at the same row
 }
 
-void rowAppendString( textRow* row, char* s, size_t len )
+void trigramRowDeleted(int at)
 {
-    row->chars = realloc( row->chars, row->size + len + 1); // make space for the new string
-    memcpy( &row->chars[row->size], s, len ); // copy the string at the end of the row
-    row->size += len; // increase the size of the current line
-    row->chars[row->size] = '\0'; // add the terminator
-    UpdateRow(row);
-    configuration.dirty ++;
+    /* called once the row at was deleted ( and no longer counted in rows_number ) */
+    struct trigramIndex* index = &configuration.trigram;
+    if( !index->enabled )
+        return;
+    index->uid_to_row[index->row_uid[at]] = -1;
+    memmove(&index->row_uid[at], &index->row_uid[at + 1], sizeof(unsigned int) * ( configuration.rows_number - at ));
+    trigramTrackRows(at);
+    if( !index->ready && at < index->build_row )
+        index->build_row --;
 }
 
-/*** Editor operations ***/
+void trigramRowsDropped(int count)
+{
+    /* the first count rows are gone, rows_number already counts without them */
+    struct trigramIndex* index = &configuration.trigram;
+    if( !index->enabled )
+        return;
+    for( int i = 0; i < count; i ++ )
+        index->uid_to_row[index->row_uid[i]] = -1;
+    memmove(index->row_uid, &index->row_uid[count], sizeof(unsigned int) * configuration.rows_number);
+    trigramTrackRows(0);
+    if( !index->ready )
+        index->build_row = index->build_row > count ? index->build_row - count : 0;
+}
 
-void insertNewLine()
+int trigramBuildStep(long long deadline)
 {
-    if( configuration.cursorX == 0 )
-    {
-        insertRow(configuration.cursorY, "", 0);
-    }
-    else
+    /* indexes rows until the deadline passes, returns 1 when the whole document is indexed */
+    struct trigramIndex* index = &configuration.trigram;
+    while( index->build_row < configuration.rows_number )
     {
-        textRow* row = &configuration.row[configuration.cursorY]; // we trunchiate the current row into two and we move  one on the next line,
-        insertRow(configuration.cursorY + 1, &row->chars[configuration.cursorX], row->size - configuration.cursorX);
-        row = &configuration.row[configuration.cursorY]; // we reinitialize our pointer and we place the terminator on our first part of the trunchiated sequence 
-        row->size = configuration.cursorX;
-        row->chars[row->size] = '\0';
-        UpdateRow(row);
+        trigramAddRow(&configuration.row[index->build_row++]);
+        if( ( index->build_row & 255 ) == 0 && monotonicMs() >= deadline )
+            return 0;
     }
-    configuration.cursorY ++;
-    configuration.cursorX = 0;
+    index->ready = 1;
+    index->entries_after_build = index->entries;
+    return 1;
 }
 
-void insertChar(int c)
+int compareInts(const void* a, const void* b)
 {
-    if( configuration.cursorY == configuration.rows_number )
-        insertRow(configuration.rows_number, "", 0);   // in case we are at the end of our file.
-    rowInsertChar(&configuration.row[configuration.cursorY], configuration.cursorX, c);
-    configuration.cursorX++;
+    int x = *(const int*)a, y = *(const int*)b;
+    return ( x > y ) - ( x < y );
 }
 
-void deleteChar()
+int lowerBound(const int* values, int count, int value)
 {
-    if( configuration.cursorY == configuration.rows_number )
-        return;
-    if( configuration.cursorX == 0 && configuration.cursorY == 0 )
-        return;
-    textRow* row = &configuration.row[configuration.cursorY];
-    if( configuration.cursorX > 0 )
+    // index of the first element of the sorted array which is >= value ( count if there is none )
+    int lo = 0, hi = count;
+    while( lo < hi )
     {
-        rowDeleteChar(row, configuration.cursorX - 1);
-        configuration.cursorX --;
+        int mid = ( lo + hi ) / 2;
+        if( values[mid] < value )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int trigramCandidates(const char* query, int** rows)
+{
+    /*
+    Stores in *rows the sorted, distinct indexes of the rows which may contain the query and returns how many there are.
+    Returns -1 when the index can't answer ( it isn't built yet or the query is shorter than a trigram ), the caller
+    then has to look at every row. The returned array must be freed by the caller.
+    */
+    struct trigramIndex* index = &configuration.trigram;
+    int query_len = strlen(query);
+    if( !index->ready || query_len < 3 )
+        return -1;
+
+    struct trigramPosting* rarest = NULL;
+    for( int i = 0; i + 2 < query_len; i ++ )
+    {
+        struct trigramPosting* posting = &index->buckets[trigramHash(&query[i])];
+        if( rarest == NULL || posting->len < rarest->len )
+            rarest = posting;
+    }
+
+    int count = 0;
+    *rows = malloc(sizeof(int) * ( rarest->len + 1 ));
+    for( int i = 0; i < rarest->len; i ++ )
+    {
+        int at = index->uid_to_row[rarest->uids[i]];
+        if( at != -1 )
+            (*rows)[count++] = at;
+    }
+    qsort(*rows, count, sizeof(int), compareInts);
+
+    int distinct = 0;
+    for( int i = 0; i < count; i ++ )
+        if( distinct == 0 || (*rows)[distinct - 1] != (*rows)[i] )
+            (*rows)[distinct++] = (*rows)[i];
+    return distinct;
+}
+
+/*** Background work ***/
+
+int editorIdlePending()
+{
+    return configuration.loader.fp != NULL || configuration.follow.changed ||
+        ( configuration.trigram.enabled && !configuration.trigram.ready );
+}
+
+void editorIdle()
+{
+    /* runs one short slice of background work, it is called by editorReadKey() only while no key is waiting */
+    long long deadline = monotonicMs() + LEAF_IDLE_SLICE_MS;
+    if( configuration.loader.fp )
+    {
+        loadRows(deadline);
+        if( configuration.loader.fp == NULL || deadline - configuration.loader.shown_at >= LEAF_INPUT_IDLE_MS )
+        {
+            configuration.loader.shown_at = deadline;
+            refreshScreen(); // no key is coming to redraw the screen, but the line count in the status bar grew
+        }
+    }
+    else if( configuration.follow.changed )
+    {
+        if( configuration.follow.on )
+            followRead(deadline);
+        else
+            externalCheck();
+        refreshScreen();
+    }
+    else if( configuration.trigram.enabled && !configuration.trigram.ready )
+        trigramBuildStep(deadline);
+    if( configuration.follow.fd != -1 && configuration.follow.watch == -1 )
+        followWatch(); // the file was deleted or renamed away, maybe a new one has its name by now
+    journalTick();
+}
+
+/*** Latency ***/
+
+/*
+Every frame the editor measures where the time since the key went: the edit itself ( editorProcessKeypress() up to the
+frame, without highlighting ), highlighting ( every highlightRow() call ), building the frame, writing it out, and the
+whole way from the key to the screen. The times go into one histogram per stage, HDR style: exact below 32 microseconds,
+above that 16 buckets per power of two, so a value is known within about 6% and the whole thing is a few fixed arrays.
+Recording a value is a couple of shifts and an increment, it is always on. Ctrl-P shows p50/p99/max of one stage in the
+status bar and the next one at the next press.
+*/
+
+const char* latency_stage_names[LATENCY_STAGES] = { "key to screen", "edit", "highlight", "frame build", "write" };
+
+int latencyBucket(long long us)
+{
+    if( us < 32 )
+        return us < 0 ? 0 : us;
+    int exponent = 63 - __builtin_clzll(us); // at least 5
+    int bucket = 32 + ( exponent - 5 ) * 16 + (int)( ( us >> ( exponent - 4 ) ) - 16 );
+    return bucket < LEAF_LATENCY_BUCKETS ? bucket : LEAF_LATENCY_BUCKETS - 1;
+}
+
+long long latencyBucketTop(int bucket)
+{
+    /* the largest value that falls into the bucket */
+    if( bucket < 32 )
+        return bucket;
+    int exponent = 5 + ( bucket - 32 ) / 16;
+    long long mantissa = 16 + ( bucket - 32 ) % 16;
+    return ( ( mantissa + 1 ) << ( exponent - 4 ) ) - 1;
+}
+
+void latencyRecord(int stage, long long us)
+{
+    struct latencyHistogram* histogram = &configuration.latency.stage[stage];
+    histogram->counts[latencyBucket(us)] ++;
+    histogram->count ++;
+    if( us > histogram->max )
+        histogram->max = us;
+}
+
+long long latencyPercentile(int stage, double percentile)
+{
+    struct latencyHistogram* histogram = &configuration.latency.stage[stage];
+    long long wanted = (long long)( histogram->count * percentile / 100.0 + 0.999999 );
+    long long seen = 0;
+    for( int i = 0; i < LEAF_LATENCY_BUCKETS; i ++ )
+    {
+        seen += histogram->counts[i];
+        if( seen >= wanted && seen > 0 )
+            return latencyBucketTop(i) < histogram->max ? latencyBucketTop(i) : histogram->max;
+    }
+    return 0;
+}
+
+void latencyShow()
+{
+    struct latencyStats* latency = &configuration.latency;
+    int stage = latency->shown;
+    latency->shown = ( latency->shown + 1 ) % LATENCY_STAGES;
+    setStatusMessage("%s: p50 %.2fms p99 %.2fms max %.2fms (%lld)", latency_stage_names[stage],
+        latencyPercentile(stage, 50) / 1000.0, latencyPercentile(stage, 99) / 1000.0,
+        latency->stage[stage].max / 1000.0, latency->stage[stage].count);
+}
+
+/*** Trace ***/
+
+/*
+leaf --trace out.json records how long the interesting functions take ( opening, UpdateRow(), updateSyntax(), searching,
+saving, refreshScreen() ) as Chrome trace events, which chrome://tracing and Perfetto open directly. Every call becomes
+one complete event ( "ph":"X", its begin and its duration ), so a ring that wrapped around never holds a end without its
+begin. The ring keeps the last LEAF_TRACE_EVENTS calls, a slot is claimed with one atomic add so recording needs no lock
+even from a second thread. The events are written out at exit, and Ctrl-O writes them at any time.
+
+A traced function does:
+
+    long long start = traceBegin();
+    ...
+    traceEnd("name", start);
+
+traceBegin() returns 0 when tracing is off and traceEnd() then does nothing, so the cost is one test per call.
+*/
+
+long long traceBegin()
+{
+    return configuration.trace.on ? monotonicUs() : 0;
+}
+
+void traceEnd(const char* name, long long start)
+{
+    struct traceRing* trace = &configuration.trace;
+    if( start == 0 )
+        return;
+    unsigned long long slot = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+    struct traceEvent* event = &trace->events[slot % LEAF_TRACE_EVENTS];
+    event->name = name; // always a string literal, the ring doesn't copy names
+    event->start = start;
+    event->duration = monotonicUs() - start;
+}
+
+int traceDump()
+{
+    /* writes the ring as a JSON trace, returns the number of events or -1 */
+    struct traceRing* trace = &configuration.trace;
+    if( !trace->on )
+        return -1;
+    FILE* fp = fopen(trace->path, "w");
+    if( fp == NULL )
+        return -1;
+    unsigned long long head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    unsigned long long first = head > LEAF_TRACE_EVENTS ? head - LEAF_TRACE_EVENTS : 0;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for( unsigned long long i = first; i < head; i ++ )
+    {
+        struct traceEvent* event = &trace->events[i % LEAF_TRACE_EVENTS];
+        fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":1}%s\n", event->name,
+                event->start - trace->origin, event->duration, i + 1 < head ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    if( fclose(fp) != 0 )
+        return -1;
+    return head - first;
+}
+
+void traceExit()
+{
+    traceDump();
+}
+
+void traceKey()
+{
+    int count = traceDump();
+    if( count == -1 )
+        setStatusMessage(configuration.trace.on ? "Trace not written: %s" : "Tracing is off, start leaf with --trace file",
+                         strerror(errno));
+    else
+        setStatusMessage("%d trace events written to %s", count, configuration.trace.path);
+}
+
+void traceStart(char* path)
+{
+    struct traceRing* trace = &configuration.trace;
+    trace->events = calloc(LEAF_TRACE_EVENTS, sizeof(struct traceEvent));
+    if( trace->events == NULL )
+        return;
+    trace->path = path;
+    trace->origin = monotonicUs() - 1; // no event starts at 0, that is what traceBegin() returns when tracing is off
+    trace->on = 1;
+    atexit(traceExit);
+}
+
+/*** Headless ***/
+
+/*
+leaf --headless script file runs the editor without a terminal, to measure it. The keys come from the script instead of the
+keyboard ( through the same input ring, so they are parsed exactly like typed keys ) and every frame refreshScreen() builds
+is copied into a memory sink instead of being written out. The script is a list of lines:
+
+    # a comment
+    phase NAME          starts a new timed phase
+    text COUNT STRING   types STRING COUNT times, \r \t \e \\ and \xHH are escapes
+    key COUNT NAME      presses a key COUNT times: up down left right home end pageup pagedown enter esc backspace del
+                        or ctrl-a ... ctrl-z
+    idle                lets the background work ( the search index ) run to the end
+    memory              prints what the editor holds in memory at this point ( see memoryReport() )
+
+When the script is over the editor prints how long every phase took, the time spent opening the file included, and exits.
+*/
+
+long long monotonicUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void headlessAddKeys(const char* keys, int len, long long count)
+{
+    if( configuration.headless.len + len * count > INT_MAX ) // a script that types gigabytes is a mistake
+        count = 0;
+    configuration.headless.keys = realloc(configuration.headless.keys, configuration.headless.len + len * count + 1);
+    for( long long i = 0; i < count; i ++ )
+    {
+        memcpy(&configuration.headless.keys[configuration.headless.len], keys, len);
+        configuration.headless.len += len;
+    }
+}
+
+void headlessAddEvent(int kind, const char* name)
+{
+    configuration.headless.events = realloc(configuration.headless.events, sizeof(struct headlessEvent) * ( configuration.headless.event_count + 1 ));
+    struct headlessEvent* event = &configuration.headless.events[configuration.headless.event_count ++];
+    memset(event, 0, sizeof(*event));
+    event->kind = kind;
+    snprintf(event->name, sizeof(event->name), "%s", name);
+    event->at = configuration.headless.len;
+}
+
+int headlessUnescape(const char* s, char* out)
+{
+    int len = 0;
+    while( *s )
+    {
+        if( *s != '\\' || s[1] == '\0' )
+        {
+            out[len ++] = *s ++;
+            continue;
+        }
+        s ++;
+        switch( *s )
+        {
+            case 'r': out[len ++] = '\r'; break;
+            case 'n': out[len ++] = '\n'; break;
+            case 't': out[len ++] = '\t'; break;
+            case 'e': out[len ++] = '\x1b'; break;
+            case 'x':
+            {
+                unsigned int value = 0;
+                int digits = 0;
+                while( digits < 2 && isxdigit((unsigned char)s[1]) )
+                {
+                    value = value * 16 + ( isdigit((unsigned char)s[1]) ? s[1] - '0' : tolower((unsigned char)s[1]) - 'a' + 10 );
+                    s ++;
+                    digits ++;
+                }
+                out[len ++] = value;
+                break;
+            }
+            default: out[len ++] = *s; break;
+        }
+        s ++;
+    }
+    return len;
+}
+
+const char* headlessKeyName(const char* name)
+{
+    static char ctrl[2];
+    static const char* names[][2] = {
+        {"up", "\x1b[A"}, {"down", "\x1b[B"}, {"right", "\x1b[C"}, {"left", "\x1b[D"}, {"home", "\x1b[H"}, {"end", "\x1b[F"},
+        {"pageup", "\x1b[5~"}, {"pagedown", "\x1b[6~"}, {"del", "\x1b[3~"}, {"enter", "\r"}, {"esc", "\x1b"}, {"backspace", "\x7f"}
+    };
+    for( unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); i ++ )
+        if( !strcmp(name, names[i][0]) )
+            return names[i][1];
+    if( !strncmp(name, "ctrl-", 5) && islower((unsigned char)name[5]) && name[6] == '\0' )
+    {
+        ctrl[0] = CTRL_KEY(name[5]);
+        ctrl[1] = '\0';
+        return ctrl;
+    }
+    return NULL;
+}
+
+int headlessLoad(const char* filename)
+{
+    /* compiles the script into one string of keys and the events between them, -1 ( and a message ) if it is wrong */
+    FILE* fp = fopen(filename, "r");
+    if( fp == NULL )
+    {
+        perror(filename);
+        return -1;
+    }
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int line_number = 0;
+    headlessAddKeys("", 0, 0);
+    headlessAddEvent(HEADLESS_PHASE, "open"); // main() starts it before the file is opened
+    configuration.headless.next = 1;
+    configuration.headless.phase = -1;
+    while( ( length = getline(&line, &capacity, fp) ) != -1 )
+    {
+        line_number ++;
+        while( length > 0 && ( line[length - 1] == '\n' || line[length - 1] == '\r' ) )
+            line[-- length] = '\0';
+        char argument[32];
+        long long count;
+        int used = 0;
+        if( length == 0 || line[0] == '#' )
+            continue;
+        if( sscanf(line, "phase %31s", argument) == 1 )
+            headlessAddEvent(HEADLESS_PHASE, argument);
+        else if( !strcmp(line, "idle") )
+            headlessAddEvent(HEADLESS_IDLE, "idle");
+        else if( !strcmp(line, "memory") )
+            headlessAddEvent(HEADLESS_MEMORY, "memory");
+        else if( sscanf(line, "text %lld %n", &count, &used) == 1 && used > 0 && count >= 0 )
+        {
+            char* text = malloc(length + 1);
+            int text_len = headlessUnescape(&line[used], text);
+            headlessAddKeys(text, text_len, count);
+            free(text);
+        }
+        else if( sscanf(line, "key %lld %31s", &count, argument) == 2 && count >= 0 && headlessKeyName(argument) != NULL )
+        {
+            const char* keys = headlessKeyName(argument);
+            headlessAddKeys(keys, strlen(keys), count);
+        }
+        else
+        {
+            fprintf(stderr, "%s:%d: can't understand \"%s\"\n", filename, line_number, line);
+            free(line);
+            fclose(fp);
+            return -1;
+        }
+    }
+    free(line);
+    fclose(fp);
+    configuration.headless.on = 1;
+    return 0;
+}
+
+void headlessPhaseEnd()
+{
+    if( configuration.headless.phase == -1 )
+        return;
+    struct headlessEvent* event = &configuration.headless.events[configuration.headless.phase];
+    event->us = monotonicUs() - event->start_us;
+    event->keys = configuration.undo.key - event->keys; // undo counts the keys the editor processed
+    event->frames = configuration.headless.frames - event->frames;
+    event->screen_bytes = configuration.headless.screen_bytes - event->screen_bytes;
+    configuration.headless.phase = -1;
+}
+
+void headlessPhaseStart(int at)
+{
+    headlessPhaseEnd();
+    struct headlessEvent* event = &configuration.headless.events[at];
+    event->start_us = monotonicUs();
+    event->keys = configuration.undo.key; // the counters as they were, turned into differences when the phase ends
+    event->frames = configuration.headless.frames;
+    event->screen_bytes = configuration.headless.screen_bytes;
+    configuration.headless.phase = at;
+}
+
+void headlessReport()
+{
+    /* registered with atexit(), so quitting from the script prints the report too */
+    headlessPhaseEnd();
+    printf("%-16s %12s %10s %8s %12s\n", "phase", "ms", "keys", "frames", "screen KB");
+    for( int i = 0; i < configuration.headless.event_count; i ++ )
+    {
+        struct headlessEvent* event = &configuration.headless.events[i];
+        if( event->kind == HEADLESS_PHASE )
+            printf("%-16s %12.3f %10lld %8lld %12.1f\n", event->name, event->us / 1000.0, event->keys, event->frames,
+                   event->screen_bytes / 1024.0);
+    }
+    printf("\n%-16s %12s %10s %10s\n", "latency", "p50 ms", "p99 ms", "max ms");
+    for( int stage = 0; stage < LATENCY_STAGES; stage ++ )
+        printf("%-16s %12.3f %10.3f %10.3f\n", latency_stage_names[stage], latencyPercentile(stage, 50) / 1000.0,
+               latencyPercentile(stage, 99) / 1000.0, configuration.latency.stage[stage].max / 1000.0);
+}
+
+int headlessFill(unsigned char* to, unsigned int space)
+{
+    /* what inputFill() does in headless mode: hands out the next keys of the script, never past the next event */
+    while( configuration.headless.next < configuration.headless.event_count && configuration.headless.events[configuration.headless.next].at == configuration.headless.pos )
+    {
+        struct headlessEvent* event = &configuration.headless.events[configuration.headless.next];
+        if( event->kind == HEADLESS_IDLE )
+        {
+            if( editorIdlePending() )
+                return 0; // no input, so editorReadKey() runs the background work and asks again
+        }
+        else if( event->kind == HEADLESS_MEMORY )
+            memoryReport();
+        else
+            headlessPhaseStart(configuration.headless.next);
+        configuration.headless.next ++;
+    }
+    if( configuration.headless.pos == configuration.headless.len )
+        exit(0);
+    long long until = ( configuration.headless.next < configuration.headless.event_count ) ? configuration.headless.events[configuration.headless.next].at : configuration.headless.len;
+    if( until - configuration.headless.pos < space )
+        space = until - configuration.headless.pos;
+    memcpy(to, &configuration.headless.keys[configuration.headless.pos], space);
+    configuration.headless.pos += space;
+    return space;
+}
+
+void screenWrite(const char* s, size_t len)
+{
+    /* everything refreshScreen() draws goes through here, headless it only lands in memory */
+    if( !configuration.headless.on )
+    {
+        write(STDOUT_FILENO, s, len);
+        return;
+    }
+    if( len > configuration.headless.sink_capacity )
+    {
+        configuration.headless.sink_capacity = len;
+        configuration.headless.sink = realloc(configuration.headless.sink, len);
+    }
+    memcpy(configuration.headless.sink, s, len);
+    configuration.headless.frames ++;
+    configuration.headless.screen_bytes += len;
+}
+
+/*** Gap buffer ***/
+
+/*
+Typing used to realloc the row by one byte and memmove its whole tail for every character. Now the row the user is typing in
+keeps a gap ( unused bytes ) at the cursor inside its chars allocation:
+
+    chars = [ text before the cursor ][ gap ][ text after the cursor ]
+
+Inserting a character fills the first byte of the gap and backspace just widens it, so typing on a 100KB line costs O(1) per key
+instead of moving the rest of the line. Only one row owns the gap at a time. When the cursor leaves that row ( or anything wants
+to read the row as a plain string ) gapCommit() moves the tail back and the row is a flat, null terminated string again.
+Everything that runs while typing ( UpdateRow, the tab table ) reads the row through rowSegments().
+*/
+
+void rowSegments(textRow* row, const char** seg, int* seg_len)
+{
+    /* the text of a row as two consecutive pieces, the second one is empty unless the row owns the gap */
+    if( row->idx == configuration.gap.row )
+    {
+        seg[0] = row->chars;
+        seg_len[0] = configuration.gap.start;
+        seg[1] = row->chars + configuration.gap.start + configuration.gap.len;
+        seg_len[1] = row->size - configuration.gap.start;
+    }
+    else
+    {
+        seg[0] = row->chars;
+        seg_len[0] = row->size;
+        seg[1] = row->chars + row->size;
+        seg_len[1] = 0;
+    }
+}
+
+char rowCharAt(textRow* row, int at)
+{
+    const char* seg[2];
+    int seg_len[2];
+    rowSegments(row, seg, seg_len);
+    return ( at < seg_len[0] ) ? seg[0][at] : seg[1][at - seg_len[0]];
+}
+
+void gapCommit()
+{
+    struct gapBuffer* gap = &configuration.gap;
+    if( gap->row == -1 )
+        return;
+    textRow* row = editorRowIfLoaded(gap->row); // the window never moves before the gap is closed
+    memmove(&row->chars[gap->start], &row->chars[gap->start + gap->len], row->size - gap->start); // we close the gap
+    row->chars[row->size] = '\0';
+    gap->row = -1;
+    trigramRowChanged(row); // the index skipped the row while it was split
+}
+
+void gapMoveTo(textRow* row, int at)
+{
+    /* makes row the owner of the gap and moves the gap to the offset at */
+    struct gapBuffer* gap = &configuration.gap;
+    if( gap->row != row->idx )
+    {
+        gapCommit();
+        row->chars = rowBufResize(row->chars, &row->chars_class, row->size + 1, row->size + LEAF_GAP_MIN + 1);
+        gap->row = row->idx;
+        gap->start = row->size;
+        gap->len = rowBufSize(row->chars_class) - row->size - 1; // all the spare capacity of the buffer becomes the gap
+    }
+    if( at < gap->start )
+        memmove(&row->chars[at + gap->len], &row->chars[at], gap->start - at);
+    else if( at > gap->start )
+        memmove(&row->chars[gap->start], &row->chars[gap->start + gap->len], at - gap->start);
+    gap->start = at;
+}
+
+void gapReserve(textRow* row)
+{
+    /* makes sure the gap has room for at least one more character, growing it geometrically so typing stays O(1) amortized */
+    struct gapBuffer* gap = &configuration.gap;
+    if( gap->len > 0 )
+        return;
+    int grow = row->size > LEAF_GAP_MIN ? row->size : LEAF_GAP_MIN;
+    row->chars = rowBufResize(row->chars, &row->chars_class, row->size + 1, row->size + grow + 1);
+    grow = rowBufSize(row->chars_class) - row->size - 1;
+    memmove(&row->chars[gap->start + grow], &row->chars[gap->start], row->size - gap->start + 1);
+    gap->len = grow;
+}
+
+/*** Rope ***/
+
+/*
+For files of several gigabytes the row array doesn't work: it needs a malloc and a render per line before the first screen
+is drawn, and the byte counts overflow an int. With --rope ( leaf --rope file ) the document is kept in a rope instead:
+
+  - a B+ tree whose leaves hold up to ROPE_LEAF_MAX bytes and whose inner nodes hold up to ROPE_FANOUT children
+  - every node stores the bytes and the newlines below it as 64 bit counts, so finding the start of a line or a byte offset
+    costs O(log n)
+  - at open the file is mmap()ed and the leaves point straight into the mapping, a leaf is copied to the heap only the first
+    time it is edited
+
+The editor keeps only a window of materialized rows ( see editorRow() ), every edit of a row is also applied to the rope and
+saving streams the leaves to disk. Inner nodes are not merged when deletions leave them underfull, they are only dropped
+once they are empty, which keeps the code short and the depth can only shrink.
+*/
+
+#define ROPE_LEAF_MAX (64 * 1024)
+#define ROPE_FANOUT 32
+
+struct ropeLeaf{
+    char* data;
+    int len;
+    int capacity;       // 0 while data still points into the mapped file
+    long long lines;    // newlines in data
+};
+
+struct ropeNode{
+    long long bytes;
+    long long lines;
+    int count;
+    int leaves;         // 1 if the children are ropeLeaf structs, 0 if they are ropeNode structs
+    void* child[ROPE_FANOUT];
+};
+
+struct rope{
+    struct ropeNode* root;
+    char* map;          // the mapped file, NULL for an empty file
+    size_t map_len;
+    long long longest_line; // in bytes, measured when the file is opened
+};
+
+long long countNewlines(const char* s, long long len)
+{
+    long long lines = 0;
+    const char* end = s + len;
+    while( s < end && ( s = memchr(s, '\n', end - s) ) != NULL )
+    {
+        lines ++;
+        s ++;
+    }
+    return lines;
+}
+
+long long ropeChildBytes(struct ropeNode* node, int i)
+{
+    return node->leaves ? ((struct ropeLeaf*)node->child[i])->len : ((struct ropeNode*)node->child[i])->bytes;
+}
+
+long long ropeChildLines(struct ropeNode* node, int i)
+{
+    return node->leaves ? ((struct ropeLeaf*)node->child[i])->lines : ((struct ropeNode*)node->child[i])->lines;
+}
+
+void ropeNodeSum(struct ropeNode* node)
+{
+    node->bytes = 0;
+    node->lines = 0;
+    for( int i = 0; i < node->count; i ++ )
+    {
+        node->bytes += ropeChildBytes(node, i);
+        node->lines += ropeChildLines(node, i);
+    }
+}
+
+struct ropeNode* ropeNewNode(int leaves)
+{
+    struct ropeNode* node = calloc(1, sizeof(struct ropeNode));
+    node->leaves = leaves;
+    return node;
+}
+
+struct ropeLeaf* ropeNewLeaf(char* data, int len, int mapped)
+{
+    struct ropeLeaf* leaf = malloc(sizeof(struct ropeLeaf));
+    leaf->len = len;
+    leaf->lines = countNewlines(data, len);
+    if( mapped )
+    {
+        leaf->data = data;
+        leaf->capacity = 0;
+    }
+    else
+    {
+        leaf->capacity = len > 0 ? len : 1;
+        leaf->data = malloc(leaf->capacity);
+        memcpy(leaf->data, data, len);
+    }
+    return leaf;
+}
+
+void ropeLeafReserve(struct ropeLeaf* leaf, int need)
+{
+    /* makes the leaf writable ( copying it out of the mapping ) with room for need bytes */
+    if( leaf->capacity >= need )
+        return;
+    int capacity = leaf->capacity * 2 > need ? leaf->capacity * 2 : need;
+    if( capacity > ROPE_LEAF_MAX )
+        capacity = need > ROPE_LEAF_MAX ? need : ROPE_LEAF_MAX;
+    char* data = malloc(capacity);
+    memcpy(data, leaf->data, leaf->len);
+    if( leaf->capacity )
+        free(leaf->data);
+    leaf->data = data;
+    leaf->capacity = capacity;
+}
+
+void ropeFree(void* node, int is_leaf)
+{
+    if( is_leaf )
+    {
+        struct ropeLeaf* leaf = node;
+        if( leaf->capacity )
+            free(leaf->data);
+        free(leaf);
+        return;
+    }
+    struct ropeNode* inner = node;
+    for( int i = 0; i < inner->count; i ++ )
+        ropeFree(inner->child[i], inner->leaves);
+    free(inner);
+}
+
+void ropeClose(struct rope* rope)
+{
+    ropeFree(rope->root, 0);
+    if( rope->map )
+        munmap(rope->map, rope->map_len);
+    free(rope);
+}
+
+int ropeInsertRec(void* node, int is_leaf, long long offset, const char* text, int len, void** out)
+{
+    /*
+    Inserts text at offset inside the subtree. The subtree may have to split: the pieces that replace it are written to out
+    ( at most 3 for a leaf, 2 for a inner node ) and their number is returned.
+    */
+    if( is_leaf )
+    {
+        struct ropeLeaf* leaf = node;
+        int at = (int)offset;
+        out[0] = leaf;
+        if( leaf->len + len <= ROPE_LEAF_MAX )
+        {
+            ropeLeafReserve(leaf, leaf->len + len);
+            memmove(&leaf->data[at + len], &leaf->data[at], leaf->len - at);
+            memcpy(&leaf->data[at], text, len);
+            leaf->len += len;
+            leaf->lines += countNewlines(text, len);
+            return 1;
+        }
+        /* the leaf overflows, we cut the joined text in pieces that are half full so the next edits fit again */
+        int total = leaf->len + len;
+        char* joined = malloc(total);
+        memcpy(joined, leaf->data, at);
+        memcpy(joined + at, text, len);
+        memcpy(joined + at + len, leaf->data + at, leaf->len - at);
+        int pieces = ( total + ROPE_LEAF_MAX / 2 - 1 ) / ( ROPE_LEAF_MAX / 2 );
+        int from = 0;
+        for( int i = 0; i < pieces; i ++ )
+        {
+            int to = (int)( (long long)total * ( i + 1 ) / pieces );
+            if( i == 0 )
+            {
+                if( leaf->capacity )
+                    free(leaf->data);
+                struct ropeLeaf* first = ropeNewLeaf(joined, to, 0);
+                *leaf = *first;
+                free(first);
+            }
+            else
+                out[i] = ropeNewLeaf(joined + from, to - from, 0);
+            from = to;
+        }
+        free(joined);
+        return pieces;
+    }
+
+    struct ropeNode* inner = node;
+    if( inner->count == 0 ) // only a empty root has no children
+        inner->child[inner->count ++] = ropeNewLeaf("", 0, 0);
+    int i = 0;
+    while( i < inner->count - 1 && offset >= ropeChildBytes(inner, i) ) // at the end of a child we prefer to append to it
+    {
+        offset -= ropeChildBytes(inner, i);
+        i ++;
+    }
+    void* pieces[3];
+    int count = ropeInsertRec(inner->child[i], inner->leaves, offset, text, len, pieces);
+
+    void* children[ROPE_FANOUT + 2];
+    int total = 0;
+    for( int j = 0; j < inner->count; j ++ )
+    {
+        if( j != i )
+            children[total ++] = inner->child[j];
+        else
+            for( int k = 0; k < count; k ++ )
+                children[total ++] = pieces[k];
+    }
+    out[0] = inner;
+    if( total <= ROPE_FANOUT )
+    {
+        memcpy(inner->child, children, sizeof(void*) * total);
+        inner->count = total;
+        ropeNodeSum(inner);
+        return 1;
+    }
+    struct ropeNode* right = ropeNewNode(inner->leaves);
+    inner->count = total / 2;
+    right->count = total - inner->count;
+    memcpy(inner->child, children, sizeof(void*) * inner->count);
+    memcpy(right->child, children + inner->count, sizeof(void*) * right->count);
+    ropeNodeSum(inner);
+    ropeNodeSum(right);
+    out[1] = right;
+    return 2;
+}
+
+void ropeInsert(struct rope* rope, long long offset, const char* text, long long len)
+{
+    while( len > 0 )
+    {
+        /* long text goes in in chunks of half a leaf, that bounds how many pieces a single insertion can split into */
+        int chunk = len > ROPE_LEAF_MAX / 2 ? ROPE_LEAF_MAX / 2 : (int)len;
+        void* pieces[3];
+        if( ropeInsertRec(rope->root, 0, offset, text, chunk, pieces) == 2 )
+        {
+            struct ropeNode* root = ropeNewNode(0);
+            root->child[0] = pieces[0];
+            root->child[1] = pieces[1];
+            root->count = 2;
+            ropeNodeSum(root);
+            rope->root = root;
+        }
+        offset += chunk;
+        text += chunk;
+        len -= chunk;
+    }
+}
+
+int ropeDeleteRec(void* node, int is_leaf, long long offset, long long len)
+{
+    /* deletes [offset, offset + len) inside the subtree and returns 1 if the subtree is now empty */
+    if( is_leaf )
+    {
+        struct ropeLeaf* leaf = node;
+        int at = (int)offset;
+        if( at == 0 && len == leaf->len )
+            return 1;
+        leaf->lines -= countNewlines(leaf->data + at, len);
+        if( leaf->capacity == 0 && at == 0 )
+            leaf->data += len;  // cutting the front of a mapped leaf doesn't need a copy
+        else if( leaf->capacity != 0 || at + len != leaf->len )
+        {
+            ropeLeafReserve(leaf, leaf->len);
+            memmove(&leaf->data[at], &leaf->data[at + len], leaf->len - at - len);
+        }
+        leaf->len -= (int)len;
+        return 0;
+    }
+
+    struct ropeNode* inner = node;
+    long long start = 0;
+    int kept = 0;
+    for( int i = 0; i < inner->count; i ++ )
+    {
+        long long bytes = ropeChildBytes(inner, i);
+        long long from = offset > start ? offset - start : 0;
+        long long to = offset + len < start + bytes ? offset + len - start : bytes;
+        start += bytes;
+        if( from < to && ropeDeleteRec(inner->child[i], inner->leaves, from, to - from) )
+            ropeFree(inner->child[i], inner->leaves);
+        else
+            inner->child[kept ++] = inner->child[i];
+    }
+    inner->count = kept;
+    ropeNodeSum(inner);
+    return kept == 0;
+}
+
+void ropeDelete(struct rope* rope, long long offset, long long len)
+{
+    if( len <= 0 )
+        return;
+    ropeDeleteRec(rope->root, 0, offset, len);
+    while( !rope->root->leaves && rope->root->count == 1 ) // a root with a single inner child is a useless level
+    {
+        struct ropeNode* root = rope->root;
+        rope->root = root->child[0];
+        free(root);
+    }
+    if( rope->root->count == 0 )
+        rope->root->leaves = 1;
+}
+
+void ropeCopyRec(void* node, int is_leaf, long long offset, long long len, char* dst)
+{
+    if( is_leaf )
+    {
+        memcpy(dst, ((struct ropeLeaf*)node)->data + offset, len);
+        return;
+    }
+    struct ropeNode* inner = node;
+    long long start = 0;
+    for( int i = 0; i < inner->count && len > 0; i ++ )
+    {
+        long long bytes = ropeChildBytes(inner, i);
+        if( offset < start + bytes )
+        {
+            long long from = offset - start;
+            long long take = bytes - from < len ? bytes - from : len;
+            ropeCopyRec(inner->child[i], inner->leaves, from, take, dst);
+            dst += take;
+            offset += take;
+            len -= take;
+        }
+        start += bytes;
+    }
+}
+
+void ropeCopy(struct rope* rope, long long offset, long long len, char* dst)
+{
+    ropeCopyRec(rope->root, 0, offset, len, dst);
+}
+
+long long ropeFindNewlineRec(void* node, int is_leaf, long long offset)
+{
+    /* the position of the first newline at or after offset inside the subtree, -1 if there is none */
+    if( is_leaf )
+    {
+        struct ropeLeaf* leaf = node;
+        char* found = memchr(leaf->data + offset, '\n', leaf->len - offset);
+        return found ? found - leaf->data : -1;
+    }
+    struct ropeNode* inner = node;
+    long long start = 0;
+    for( int i = 0; i < inner->count; i ++ )
+    {
+        long long bytes = ropeChildBytes(inner, i);
+        if( offset < start + bytes && ropeChildLines(inner, i) > 0 ) // children without newlines are skipped unread
+        {
+            long long found = ropeFindNewlineRec(inner->child[i], inner->leaves, offset > start ? offset - start : 0);
+            if( found != -1 )
+                return start + found;
+        }
+        start += bytes;
+    }
+    return -1;
+}
+
+long long ropeLineEnd(struct rope* rope, long long offset)
+{
+    /* the offset of the newline which ends the line containing offset, or the size of the document for the last line */
+    long long found = ropeFindNewlineRec(rope->root, 0, offset);
+    return found == -1 ? rope->root->bytes : found;
+}
+
+long long ropeLineStart(struct rope* rope, long long line)
+{
+    /* the offset where the line starts ( right after its line-th newline ), the size of the document if there is no such line */
+    if( line <= 0 )
+        return 0;
+    if( line > rope->root->lines )
+        return rope->root->bytes;
+    struct ropeNode* node = rope->root;
+    long long base = 0;
+    while( 1 )
+    {
+        int i = 0;
+        while( line > ropeChildLines(node, i) )
+        {
+            line -= ropeChildLines(node, i);
+            base += ropeChildBytes(node, i);
+            i ++;
+        }
+        if( !node->leaves )
+        {
+            node = node->child[i];
+            continue;
+        }
+        struct ropeLeaf* leaf = node->child[i];
+        const char* s = leaf->data;
+        while( 1 )
+        {
+            s = memchr(s, '\n', leaf->len - ( s - leaf->data ));
+            if( -- line == 0 )
+                return base + ( s - leaf->data ) + 1;
+            s ++;
+        }
+    }
+}
+
+long long ropeLineOf(struct rope* rope, long long offset)
+{
+    /* the line the byte offset is in, the newlines in front of it are summed on the way down like in ropeLineStart() */
+    if( rope->root->bytes == 0 || offset <= 0 )
+        return 0;
+    if( offset > rope->root->bytes )
+        offset = rope->root->bytes;
+    struct ropeNode* node = rope->root;
+    long long line = 0;
+    while( 1 )
+    {
+        int i = 0;
+        while( i < node->count - 1 && offset >= ropeChildBytes(node, i) )
+        {
+            offset -= ropeChildBytes(node, i);
+            line += ropeChildLines(node, i);
+            i ++;
+        }
+        if( !node->leaves )
+        {
+            node = node->child[i];
+            continue;
+        }
+        struct ropeLeaf* leaf = node->child[i];
+        return line + countNewlines(leaf->data, offset);
+    }
+}
+
+int ropeSearch(const struct searchPattern* pattern, long long from, long long to, int line, int want_last, int* col)
+{
+    /*
+    Searches [from, to) of the document, which starts at the beginning of line, and returns the line of the first match ( or
+    of the last line with a match if want_last ) and in col where the first match of that line is. The text is copied out of
+    the rope in chunks of LEAF_SEARCH_CHUNK bytes cut at a newline, so no row is materialized and a search of a file of gigabytes
+    only ever holds one chunk. Every chunk starts and ends on a line boundary, so patternSearch() sees the line ends as the edges
+    of the text it gets ( the newline is a separator for whole words ) exactly like it does on a row.
+    */
+    struct rope* rope = configuration.rope;
+    int capacity = LEAF_SEARCH_CHUNK;
+    char* buffer = malloc(capacity);
+    int carry = 0; // bytes of a line cut by the end of the last chunk, they start the next one
+    int found = -1;
+    while( from < to || carry > 0 )
+    {
+        long long copy = to - from;
+        if( copy > capacity - carry )
+            copy = capacity - carry;
+        ropeCopy(rope, from, copy, buffer + carry);
+        from += copy;
+        int len = carry + copy;
+        int end = len;
+        if( from < to )
+        {
+            char* last = memrchr(buffer, '\n', len);
+            if( last == NULL ) // a line longer than the buffer, it has to grow
+            {
+                capacity *= 2;
+                buffer = realloc(buffer, capacity);
+                carry = len;
+                continue;
+            }
+            end = last - buffer + 1;
+        }
+
+        int at = 0;
+        while( 1 )
+        {
+            int match = patternSearch(pattern, buffer, end, at);
+            if( match == -1 )
+            {
+                line += countNewlines(buffer + at, end - at);
+                break;
+            }
+            line += countNewlines(buffer + at, match - at);
+            char* line_start = memrchr(buffer, '\n', match);
+            *col = match - ( line_start ? line_start - buffer + 1 : 0 );
+            found = line;
+            if( !want_last )
+            {
+                free(buffer);
+                return found;
+            }
+            char* line_end = memchr(buffer + match, '\n', end - match); // only the first match of a line counts
+            if( line_end == NULL )
+                break;
+            line ++;
+            at = line_end - buffer + 1;
+        }
+        memmove(buffer, buffer + end, len - end);
+        carry = len - end;
+    }
+    free(buffer);
+    return found;
+}
+
+int ropeFindLine(const struct searchPattern* pattern, int current, int direction, int* col)
+{
+    /* the row find() goes to next, in the same order as its walk over the rows: from current on in direction, wrapping around */
+    long long bytes = configuration.rope->root->bytes;
+    if( direction == 1 )
+    {
+        int start = ( current + 1 < configuration.rows_number ) ? current + 1 : 0;
+        long long offset = ropeLineStart(configuration.rope, start);
+        int found = ropeSearch(pattern, offset, bytes, start, 0, col);
+        return ( found != -1 ) ? found : ropeSearch(pattern, 0, offset, 0, 0, col);
+    }
+    long long offset = ropeLineStart(configuration.rope, current);
+    int found = ropeSearch(pattern, 0, offset, 0, 1, col);
+    return ( found != -1 ) ? found : ropeSearch(pattern, offset, bytes, current, 1, col);
+}
+
+long long ropeRows(struct rope* rope)
+{
+    /* the number of rows the editor shows: one per newline plus the last line if it isn't terminated */
+    long long bytes = rope->root->bytes;
+    char last = '\n';
+    if( bytes > 0 )
+        ropeCopy(rope, bytes - 1, 1, &last);
+    return rope->root->lines + ( last != '\n' );
+}
+
+int writeAll(int fd, const char* buffer, size_t len)
+{
+    /* write() may stop early ( always for more than 2GB at once ), so we loop until everything is out */
+    while( len > 0 )
+    {
+        ssize_t written = write(fd, buffer, len);
+        if( written == -1 )
+        {
+            if( errno == EINTR )
+                continue;
+            return -1;
+        }
+        buffer += written;
+        len -= written;
+    }
+    return 0;
+}
+
+unsigned long long fnvHash(unsigned long long hash, const char* data, size_t len)
+{
+    for( size_t i = 0; i < len; i ++ )
+        hash = ( hash ^ (unsigned char)data[i] ) * 1099511628211ULL;
+    return hash;
+}
+
+int ropeWriteRec(void* node, int is_leaf, int fd, unsigned long long* hash)
+{
+    /* writes the text under node and hashes it on the way, so the undo sidecar knows which file it belongs to */
+    if( is_leaf )
+    {
+        struct ropeLeaf* leaf = node;
+        *hash = fnvHash(*hash, leaf->data, leaf->len);
+        return writeAll(fd, leaf->data, leaf->len);
+    }
+    struct ropeNode* inner = node;
+    for( int i = 0; i < inner->count; i ++ )
+        if( ropeWriteRec(inner->child[i], inner->leaves, fd, hash) == -1 )
+            return -1;
+    return 0;
+}
+
+struct rope* ropeOpen(const char* filename)
+{
+    /* maps the file and builds the tree bottom up, every leaf is half full and points into the mapping */
+    int fd = open(filename, O_RDONLY);
+    if( fd == -1 )
+        return NULL;
+    struct stat st;
+    if( fstat(fd, &st) == -1 )
+    {
+        close(fd);
+        return NULL;
+    }
+    struct rope* rope = calloc(1, sizeof(struct rope));
+    rope->map_len = st.st_size;
+    if( rope->map_len > 0 )
+    {
+        rope->map = mmap(NULL, rope->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if( rope->map == MAP_FAILED )
+        {
+            close(fd);
+            free(rope);
+            return NULL;
+        }
+    }
+    close(fd); // the mapping stays valid without the descriptor
+
+    size_t count = ( rope->map_len + ROPE_LEAF_MAX / 2 - 1 ) / ( ROPE_LEAF_MAX / 2 );
+    void** level = malloc(sizeof(void*) * ( count > 0 ? count : 1 ));
+    long long line_start = 0;
+    for( size_t i = 0; i < count; i ++ )
+    {
+        size_t from = i * ( ROPE_LEAF_MAX / 2 );
+        size_t len = rope->map_len - from < ROPE_LEAF_MAX / 2 ? rope->map_len - from : ROPE_LEAF_MAX / 2;
+        struct ropeLeaf* leaf = malloc(sizeof(struct ropeLeaf));
+        leaf->data = rope->map + from;
+        leaf->len = (int)len;
+        leaf->capacity = 0;
+        leaf->lines = 0;
+        for( const char* s = leaf->data; ( s = memchr(s, '\n', leaf->data + len - s) ) != NULL; s ++ )
+        {
+            // while counting the newlines we also remember the longest line, the editor can't show lines over INT_MAX
+            long long at = s - rope->map;
+            if( at - line_start > rope->longest_line )
+                rope->longest_line = at - line_start;
+            line_start = at + 1;
+            leaf->lines ++;
+        }
+        level[i] = leaf;
+    }
+    if( (long long)rope->map_len - line_start > rope->longest_line )
+        rope->longest_line = rope->map_len - line_start;
+    int leaves = 1;
+    do
+    {
+        size_t parents = ( count + ROPE_FANOUT - 1 ) / ROPE_FANOUT;
+        if( parents == 0 )
+            parents = 1;
+        for( size_t i = 0; i < parents; i ++ )
+        {
+            struct ropeNode* node = ropeNewNode(leaves);
+            for( size_t j = i * ROPE_FANOUT; j < count && j < ( i + 1 ) * ROPE_FANOUT; j ++ )
+                node->child[node->count ++] = level[j];
+            ropeNodeSum(node);
+            level[i] = node;
+        }
+        count = parents;
+        leaves = 0;
+    } while( count > 1 );
+    rope->root = level[0];
+    free(level);
+    return rope;
+}
+
+/*** Row operations ***/
+
+struct tabStop* rowTabTable(textRow* row)
+{
+    /*
+    Builds ( once per change of the row ) the sorted list of the tabs in chars together with the render column right after
+    each of them. Between two tabs chars and render advance together, so these few entries are enough to convert any column
+    in both directions with a binary search, instead of walking the line from column 0 on every refresh.
+    */
+    struct tabCache* cache = &configuration.tab_cache;
+    if( cache->row != row->idx )
+    {
+        const char* seg[2];
+        int seg_len[2];
+        rowSegments(row, seg, seg_len);
+
+        cache->row = row->idx;
+        cache->count = 0;
+        for( int s = 0; s < 2; s ++ )
+            for( int i = 0; i < seg_len[s]; i ++ )
+                if( seg[s][i] == '\t' )
+                    cache->count ++;
+        if( cache->capacity < cache->count + 1 )
+        {
+            cache->capacity = cache->count + 1;
+            cache->tabs = realloc(cache->tabs, sizeof(struct tabStop) * cache->capacity);
+        }
+        int tab = 0, renderX = 0;
+        for( int s = 0; s < 2; s ++ )
+            for( int i = 0; i < seg_len[s]; i ++ )
+            {
+                if( seg[s][i] == '\t' )
+                {
+                    renderX += LEAF_TAB_STOP - ( renderX % LEAF_TAB_STOP );      // the tab jumps to the next tab stop
+                    cache->tabs[tab].at = ( s == 0 ) ? i : seg_len[0] + i;
+                    cache->tabs[tab].render_end = renderX;
+                    tab ++;
+                }
+                else
+                {
+                    renderX ++;
+                }
+            }
+    }
+    return cache->tabs;
+}
+
+int CursorXToRenderXConverter(textRow* row, int cursorX)
+{
+    /*
+    I look for the last tab in front of cursorX. Everything after it is rendered one to one, so the render column is the column
+    where that tab ends plus the distance from the tab. Without a tab in front, the two columns are the same.
+    */
+    struct tabStop* tabs = rowTabTable(row);
+    int lo = 0, hi = configuration.tab_cache.count; // lo becomes the number of tabs in front of cursorX
+    while( lo < hi )
+    {
+        int mid = ( lo + hi ) / 2;
+        if( tabs[mid].at < cursorX )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if( lo == 0 )
+        return cursorX;
+    return tabs[lo - 1].render_end + ( cursorX - tabs[lo - 1].at - 1 );
+}
+
+int RederXToCursorXConverter( textRow* row, int renderX )
+{
+    /*
+    The opposite direction: I look for the last tab which ends at or before renderX. From there chars and render advance together
+    until the next tab, and if renderX lands inside the spaces of that next tab, the cursor goes on the tab itself.
+    As before, a renderX past the end of the line gives the end of the line.
+    */
+    struct tabStop* tabs = rowTabTable(row);
+    int lo = 0, hi = configuration.tab_cache.count; // lo becomes the number of tabs which end at or before renderX
+    while( lo < hi )
+    {
+        int mid = ( lo + hi ) / 2;
+        if( tabs[mid].render_end <= renderX )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int from_cursorX = ( lo > 0 ) ? tabs[lo - 1].at + 1 : 0;
+    int from_renderX = ( lo > 0 ) ? tabs[lo - 1].render_end : 0;
+    int cursorX = from_cursorX + ( renderX - from_renderX );
+    if( lo < configuration.tab_cache.count && cursorX > tabs[lo].at )
+        cursorX = tabs[lo].at;
+    if( cursorX > row->size )
+        cursorX = row->size;
+    return cursorX;
+}
+
+/*
+render and highlight are always built together and read together ( the draw loop walks both side by side ), so they live
+in one block from the row allocator: render in the first half and highlight in the second. That is one allocation per row
+instead of two, and a row's glyphs and colors end up on neighbouring cache lines.
+*/
+
+void rowCellsFit(textRow* row, int cells)
+{
+    /* room for cells characters of render and highlight, the old content doesn't matter */
+    row->render = rowBufFit(row->render, &row->render_class, 2 * cells);
+    row->highlight = (unsigned char*)row->render + rowBufSize(row->render_class) / 2;
+}
+
+void rowCellsGrow(textRow* row, int cells)
+{
+    /* the same, but the current render ( with its terminator ) and highlight are kept */
+    if( cells <= rowBufSize(row->render_class) / 2 )
+        return;
+    int half = rowBufSize(row->render_class) / 2;
+    if( cells < half + half / 2 )
+        cells = half + half / 2;
+    unsigned char cls;
+    char* block = rowBufAlloc(2 * cells, &cls);
+    memcpy(block, row->render, row->rsize + 1);
+    memcpy(block + rowBufSize(cls) / 2, row->highlight, row->rsize);
+    rowBufFree(row->render, row->render_class);
+    row->render = block;
+    row->render_class = cls;
+    row->highlight = (unsigned char*)block + rowBufSize(cls) / 2;
+}
+
+void UpdateRow(textRow* row)
+{
+    long long trace_start = traceBegin();
+    const char* seg[2];
+    int seg_len[2];
+    rowSegments(row, seg, seg_len); // the row may be split by the gap while the user types in it
+
+    int tabs = 0;
+    for( int s = 0; s < 2; s ++ )
+        for( int i = 0; i < seg_len[s]; i ++ )
+            if( seg[s][i] == '\t' )
+                tabs++;
+
+    if( configuration.tab_cache.row == row->idx )
+        configuration.tab_cache.row = -1; // the chars changed, so the cached tab table is no longer valid
+
+    rowCellsFit(row, row->size + tabs*(LEAF_TAB_STOP - 1) + 1);
+    int idx = 0;
+    for( int s = 0; s < 2; s ++ )
+        for( int i = 0; i < seg_len[s]; i ++ )
+            if( seg[s][i] == '\t' )
+            {
+                row->render[idx++] = ' ';
+                while( idx % LEAF_TAB_STOP != 0 ) row->render[idx++] = ' ';
+            }
+            else
+            {
+                row->render[idx++] = seg[s][i];
+            }
+    row->render[idx] = '\0';
+    row->rsize = idx;
+    updateSyntax(row);
+    trigramRowChanged(row);
+    traceEnd("UpdateRow", trace_start);
+}
+
+int tabsBefore(struct tabStop* tabs, int count, int at)
+{
+    // how many of the tabs sit in front of the offset at
+    int lo = 0, hi = count;
+    while( lo < hi )
+    {
+        int mid = ( lo + hi ) / 2;
+        if( tabs[mid].at < at )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void UpdateRowSpan(textRow* row, int at, int inserted, int deleted)
+{
+    /*
+    The incremental version of UpdateRow, for an edit which deleted `deleted` characters at the offset at and inserted `inserted`
+    new ones there. The caller makes sure the tab table still describes the row as it was before the edit.
+
+    Everything in front of the edit renders exactly as before. After the edit the characters render the same, only shifted:
+    up to the first tab they move by shift1, and a tab snaps to the next tab stop, so everything after that tab moves by shift2,
+    which is a multiple of LEAF_TAB_STOP ( very often 0 ). So render and highlight are patched with two memmoves, the new
+    characters and the first tab are written again, and the lexer only runs from a little before the edit until it is back in
+    the state it had last time ( see highlightRow() ). Typing into a very long line doesn't depend on the length of the line.
+    */
+    struct tabCache* cache = &configuration.tab_cache;
+    struct tabStop* tabs = cache->tabs;
+    int tab_count = cache->count;
+    int first = tabsBefore(tabs, tab_count, at);                // tabs in front of the edit, they don't change
+    int tail = tabsBefore(tabs, tab_count, at + deleted);       // tabs[first .. tail) were deleted, tabs[tail ..] come after the edit
+
+    int old_rsize = row->rsize;
+    int render_at = ( first > 0 ) ? tabs[first - 1].render_end + ( at - tabs[first - 1].at - 1 ) : at;
+    int old_tail_at = ( tail > 0 ) ? tabs[tail - 1].render_end + ( at + deleted - tabs[tail - 1].at - 1 ) : at + deleted;
+
+    struct tabStop new_tabs[inserted + 1];
+    int new_tab_count = 0;
+    int new_tail_at = render_at;
+    for( int i = 0; i < inserted; i ++ )
+    {
+        if( rowCharAt(row, at + i) == '\t' )
+        {
+            new_tail_at += LEAF_TAB_STOP - ( new_tail_at % LEAF_TAB_STOP );
+            new_tabs[new_tab_count].at = at + i;
+            new_tabs[new_tab_count].render_end = new_tail_at;
+            new_tab_count ++;
+        }
+        else
+        {
+            new_tail_at ++;
+        }
+    }
+    int shift1 = new_tail_at - old_tail_at;
+
+    int shift2 = shift1;
+    int old_tab_start = old_rsize, old_tab_end = old_rsize;   // the first tab after the edit, in the old render
+    unsigned char tab_hl = HL_NORMAL;
+    if( tail < tab_count )
+    {
+        old_tab_start = old_tail_at + ( tabs[tail].at - ( at + deleted ) );
+        old_tab_end = tabs[tail].render_end;
+        int new_tab_start = old_tab_start + shift1;
+        shift2 = ( new_tab_start + LEAF_TAB_STOP - ( new_tab_start % LEAF_TAB_STOP ) ) - old_tab_end;
+        tab_hl = row->highlight[old_tab_start]; // all the spaces of a tab always share one color
+    }
+    int new_rsize = old_rsize + shift2;
+
+    if( new_rsize > old_rsize )
+    {
+        rowCellsGrow(row, new_rsize + 1);
+    }
+    /*
+    When the text after the first tab moves to the right it has to go first, otherwise the text in front of the tab
+    could overwrite it. When it moves to the left it has to go last for the same reason.
+    */
+    for( int pass = 0; pass < 2; pass ++ )
+    {
+        if( ( pass == 0 ) == ( shift2 > 0 ) )
+        {
+            memmove(&row->render[old_tab_end + shift2], &row->render[old_tab_end], old_rsize - old_tab_end);
+            memmove(&row->highlight[old_tab_end + shift2], &row->highlight[old_tab_end], old_rsize - old_tab_end);
+        }
+        else
+        {
+            memmove(&row->render[old_tail_at + shift1], &row->render[old_tail_at], old_tab_start - old_tail_at);
+            memmove(&row->highlight[old_tail_at + shift1], &row->highlight[old_tail_at], old_tab_start - old_tail_at);
+        }
+    }
+
+    int column = render_at;                                     // the inserted characters
+    for( int i = 0; i < inserted; i ++ )
+    {
+        char c = rowCharAt(row, at + i);
+        if( c == '\t' )
+        {
+            row->render[column++] = ' ';
+            while( column % LEAF_TAB_STOP != 0 ) row->render[column++] = ' ';
+        }
+        else
+        {
+            row->render[column++] = c;
+        }
+    }
+    if( tail < tab_count )                                      // and the first tab after them, which may have changed its width
+    {
+        memset(&row->render[old_tab_start + shift1], ' ', old_tab_end + shift2 - old_tab_start - shift1);
+        memset(&row->highlight[old_tab_start + shift1], tab_hl, old_tab_end + shift2 - old_tab_start - shift1);
+    }
+    row->rsize = new_rsize;
+    row->render[new_rsize] = '\0';
+
+    // the tab table: the deleted tabs go away, the new ones come in and the ones after the edit move
+    int count = tab_count - ( tail - first ) + new_tab_count;
+    if( count + 1 > cache->capacity )
+    {
+        cache->capacity = count + 1;
+        cache->tabs = tabs = realloc(tabs, sizeof(struct tabStop) * cache->capacity);
+    }
+    memmove(&tabs[first + new_tab_count], &tabs[tail], sizeof(struct tabStop) * ( tab_count - tail ));
+    memcpy(&tabs[first], new_tabs, sizeof(struct tabStop) * new_tab_count);
+    for( int i = first + new_tab_count; i < count; i ++ )
+    {
+        tabs[i].at += inserted - deleted;
+        tabs[i].render_end += shift2;
+    }
+    cache->count = count;
+
+    if( configuration.syntax == NULL )
+    {
+        memset(&row->highlight[render_at], HL_NORMAL, new_tail_at - render_at);
+    }
+    else
+    {
+        /*
+        The lexer restarts after a plain separator that is far enough in front of the edit ( see syntaxLookahead() ),
+        right after such a character it is never inside a string or a comment. Without one we start from the beginning of the row.
+        */
+        struct lexState state = { 1, 0, 0 };
+        int from = render_at - syntaxLookahead();
+        while( from > 0 && !( row->highlight[from - 1] == HL_NORMAL && is_separator(row->render[from - 1]) ) )
+            from --;
+        if( from <= 0 )
+        {
+            from = 0;
+            textRow* prev = editorRowIfLoaded(row->idx - 1);
+            state.in_comment = ( prev && prev->in_multiline_open_comment );
+        }
+        long long lex_start = monotonicUs();
+        int converged = highlightRow(row, from, &state, new_tail_at);
+        configuration.latency.highlight_us += monotonicUs() - lex_start;
+        if( !converged )
+            syntaxRowEnded(row, state.in_comment);
+    }
+    trigramRowChanged(row);
+}
+
+void initRow(textRow* row, int at, size_t len)
+{
+    /* a new row of len chars ( which the caller copies in ) without render or highlight yet */
+    row->idx = at;
+    row->size = len;
+    row->chars = rowBufAlloc(len + 1, &row->chars_class);
+    row->chars[len] = '\0';
+
+    row->rsize = 0;                                // initializing the render size and string for the new line
+    row->render = NULL;
+
+    row->highlight = NULL;
+    row->in_multiline_open_comment = 0;
+}
+
+void insertRow(int at, char* s, size_t len)             
+{
+    /*This funtion allocates a new text row in the text matrix and inserts it at the given position.*/
+    if( at < 0 || at > configuration.rows_number )
+        return;
+    gapCommit(); // the rows are about to move, so no row may stay split
+    undoRecordEdit(UNDO_INSERT_ROW, at, 0, s, len);
+    configuration.tab_cache.row = -1;
+    if( configuration.rope )
+        ropeRowInserted(at, s, len);
+    configuration.rows_number ++;
+    configuration.dirty ++;
+
+    int first = configuration.win_first;
+    int last = first + configuration.win_rows;
+    if( at < first || at > last ) 
+    {
+        if( at < first ) // a row above the window was inserted ( only possible in rope mode ), the window slides down
+            for( int i = 0; i < configuration.win_rows; i ++ )
+                configuration.row[i].idx ++;
+        configuration.win_first += ( at < first );
+        return;
+    }
+    int local = at - first;
+    configuration.row = realloc(configuration.row, sizeof(textRow) * ( configuration.win_rows + 1 ) );
+    memmove(&configuration.row[local + 1], &configuration.row[local], sizeof(textRow) * (configuration.win_rows - local));
+    for( int i = local + 1; i <= configuration.win_rows; i ++ )
+        configuration.row[i].idx ++;
+    configuration.win_rows ++;
+
+    textRow* row = &configuration.row[local];
+    initRow(row, at, len);
+    trigramRowInserted(at);
+    memcpy(row->chars, s, len);
+    UpdateRow(row);
+}   
+
+void rowInsertChar( textRow* row, int at, int c )
+{
+    if( at < 0 || at > row->size )
+        at = row->size;
+    rowTabTable(row); // UpdateRowSpan() needs the tabs as they were before the edit
+    gapMoveTo(row, at); // while typing the gap already sits at the cursor, so this moves nothing
+    gapReserve(row);
+    row->chars[configuration.gap.start ++] = c; // the character takes the first byte of the gap
+    configuration.gap.len --;
+    row->size ++;
+    char ch = c;
+    undoRecordEdit(UNDO_INSERT_TEXT, row->idx, at, &ch, 1);
+    ropeRowEdit(row, at, 0, &ch, 1);
+    UpdateRowSpan(row, at, 1, 0);
+    configuration.dirty ++;
+}
+
+void rowDeleteChar( textRow* row, int at)
+{
+    if( at < 0 || at >= row->size )
+        return;
+    char ch = rowCharAt(row, at);
+    undoRecordEdit(UNDO_DELETE_TEXT, row->idx, at, &ch, 1);
+    rowTabTable(row);
+    gapMoveTo(row, at + 1); // backspace deletes the character right in front of the gap
+    configuration.gap.start --;
+    configuration.gap.len ++;
+    row->size --;
+    ropeRowEdit(row, at, 1, NULL, 0);
+    UpdateRowSpan(row, at, 0, 1);
+    configuration.dirty ++;
+}
+
+void freeRow(textRow* row)
+{
+    rowBufFree(row->chars, row->chars_class);
+    rowBufFree(row->render, row->render_class); // the highlight goes with it
+}
+
+void deleteRow(int at)
+{
+    if( at < 0 || at >= configuration.rows_number ) //we validate the index
+        return;
+    gapCommit();
+    textRow* row = editorRow(at); // undo has to keep the text, so the row gets loaded even in rope mode
+    undoRecordEdit(UNDO_DELETE_ROW, at, 0, row->chars, row->size);
+    configuration.tab_cache.row = -1;
+    if( configuration.rope )
+        ropeRowDeleted(at);
+    configuration.rows_number --;
+    configuration.dirty ++;
+
+    int local = at - configuration.win_first;
+    freeRow(row);    //free memory owned by the deleted row
+    memmove(&configuration.row[local], &configuration.row[local + 1], sizeof(textRow) * (configuration.win_rows - local - 1)); 
+    for( int i = local; i < configuration.win_rows - 1; i ++ )
+        configuration.row[i].idx --;
+    configuration.win_rows --;//memmove() to overwrite the deleted row struct with the rest of the rows that come after it, and decrement the number of rows. 
+    trigramRowDeleted(at);
+}
+
+/*
+In rope mode configuration.row is only a window of rows materialized from the rope around the cursor and the screen.
+editorRow() is the way to reach a row by its index in the document: it loads the window around the row when it is outside.
+That invalidates every textRow* taken before, so code which needs two rows asks for the one that may move the window first.
+Every change of a row is written through to the rope right away ( ropeRowEdit() ), the rows themselves are never "dirty".
+*/
+
+textRow* editorRowIfLoaded(int at)
+{
+    if( at < configuration.win_first || at >= configuration.win_first + configuration.win_rows )
+        return NULL;
+    return &configuration.row[at - configuration.win_first];
+}
+
+void ropeLoadWindow(int around)
+{
+    gapCommit();
+    configuration.tab_cache.row = -1;
+    for( int i = 0; i < configuration.win_rows; i ++ )
+        freeRow(&configuration.row[i]);
+    int first = around - LEAF_ROPE_WINDOW / 2;
+    if( first > configuration.rows_number - LEAF_ROPE_WINDOW )
+        first = configuration.rows_number - LEAF_ROPE_WINDOW;
+    if( first < 0 )
+        first = 0;
+    int count = configuration.rows_number - first < LEAF_ROPE_WINDOW ? configuration.rows_number - first : LEAF_ROPE_WINDOW;
+    configuration.row = realloc(configuration.row, sizeof(textRow) * ( count > 0 ? count : 1 ));
+    configuration.win_first = first;
+    configuration.win_rows = 0;
+
+    long long offset = ropeLineStart(configuration.rope, first);
+    for( int i = 0; i < count; i ++ )
+    {
+        long long end = ropeLineEnd(configuration.rope, offset);
+        textRow* row = &configuration.row[i];
+        initRow(row, first + i, end - offset);
+        ropeCopy(configuration.rope, offset, end - offset, row->chars);
+        configuration.win_rows ++; // the row is in the window before it is highlighted, so the next one sees its comment state
+        UpdateRow(row);
+        offset = end + 1;
+    }
+}
+
+textRow* editorRow(int at)
+{
+    textRow* row = editorRowIfLoaded(at);
+    if( row == NULL && configuration.rope )
+    {
+        ropeLoadWindow(at);
+        row = editorRowIfLoaded(at);
+    }
+    return row;
+}
+
+void ropeRowEdit(textRow* row, int at, int deleted, const char* text, int inserted)
+{
+    /* applies a change of the chars of a row to the rope, in row mode the row is the document and there is nothing to do */
+    if( configuration.rope == NULL )
+        return;
+    long long offset = ropeLineStart(configuration.rope, row->idx) + at;
+    ropeDelete(configuration.rope, offset, deleted);
+    ropeInsert(configuration.rope, offset, text, inserted);
+}
+
+void ropeRowInserted(int at, const char* s, size_t len)
+{
+    struct rope* rope = configuration.rope;
+    long long bytes = rope->root->bytes;
+    char last = '\n';
+    if( bytes > 0 )
+        ropeCopy(rope, bytes - 1, 1, &last);
+    if( at == configuration.rows_number && last != '\n' )
+    {
+        ropeInsert(rope, bytes, "\n", 1); // the last line wasn't terminated, the new one is appended after it
+        ropeInsert(rope, bytes + 1, s, len);
+        return;
+    }
+    long long offset = ropeLineStart(rope, at);
+    ropeInsert(rope, offset, s, len);
+    ropeInsert(rope, offset + len, "\n", 1);
+}
+
+void ropeRowDeleted(int at)
+{
+    struct rope* rope = configuration.rope;
+    long long start = ropeLineStart(rope, at);
+    long long end = ropeLineEnd(rope, start);
+    if( end < rope->root->bytes )
+        end ++;     // the newline goes away with the line
+    else if( start > 0 )
+        start --;   // the last line has no newline, so we take the one in front of it
+    ropeDelete(rope, start, end - start);
+}
+
+/* rowInsertText() and rowDeleteText() are the edits undo records and replays. Typing
+ * goes through the gap instead, these are for the bigger pieces: joining lines, splitting
+ * them, and putting text back. */
+void rowInsertText(textRow* row, int at, const char* s, int len)
+{
+    gapCommit();
+    if( at < 0 || at > row->size )
+        at = row->size;
+    undoRecordEdit(UNDO_INSERT_TEXT, row->idx, at, s, len);
+    ropeRowEdit(row, at, 0, s, len);
+    row->chars = rowBufResize( row->chars, &row->chars_class, row->size + 1, row->size + len + 1);
+    memmove( &row->chars[at + len], &row->chars[at], row->size - at + 1 );
+    memcpy( &row->chars[at], s, len );
+    row->size += len;
+    UpdateRow(row);
+    configuration.dirty ++;
+}
+void rowDeleteText(textRow* row, int at, int len)
+{
+    gapCommit();
+    if( at < 0 || at >= row->size )
+        return;
+    if( len > row->size - at )
+        len = row->size - at;
+    undoRecordEdit(UNDO_DELETE_TEXT, row->idx, at, &row->chars[at], len);
+    ropeRowEdit(row, at, len, NULL, 0);
+    memmove( &row->chars[at], &row->chars[at + len], row->size - at - len + 1 );
+    row->size -= len;
+    UpdateRow(row);
+    configuration.dirty ++;
+}
+void rowAppendString( textRow* row, char* s, size_t len )
+{
+    rowInsertText(row, row->size, s, len);
+}
+
+void rowReplaceMatches( textRow* row, int* offsets, int count, int query_len, const char* with, int with_len )
+{
+    /*
+    Replaces count non overlapping matches of length query_len, starting at the given ( increasing ) offsets, with the string with.
+    The new line is built in a single pass and the row is rendered and highlighted only once, no matter how many matches there are.
+    */
+    if( count <= 0 )
+        return;
+    gapCommit();
+    int new_size = row->size + count * ( with_len - query_len );
+    unsigned char chars_class;
+    char* chars = rowBufAlloc(new_size + 1, &chars_class);
+    char* aux = chars;
+    int from = 0;
+    for( int i = 0; i < count; i ++ )
+    {
+        memcpy(aux, &row->chars[from], offsets[i] - from); // the text between the previous match and this one
+        aux += offsets[i] - from;
+        memcpy(aux, with, with_len);
+        aux += with_len;
+        from = offsets[i] + query_len;
+    }
+    memcpy(aux, &row->chars[from], row->size - from);
+    chars[new_size] = '\0';
+    undoRecordEdit(UNDO_DELETE_TEXT, row->idx, 0, row->chars, row->size); // undo sees the whole line replaced
+    undoRecordEdit(UNDO_INSERT_TEXT, row->idx, 0, chars, new_size);
+    ropeRowEdit(row, 0, row->size, chars, new_size);
+
+    rowBufFree(row->chars, row->chars_class);
+    row->chars = chars;
+    row->chars_class = chars_class;
+    row->size = new_size;
+    UpdateRow(row);
+    configuration.dirty ++;
+}
+
+/*** Editor operations ***/
+
+void insertNewLine()
+{
+    if( configuration.cursorY == configuration.rows_number )
+        loadRest(); // a row added after the loaded ones would end up in front of the rest of the file
+    gapCommit(); // the row is split using its chars as a plain string
+    if( configuration.cursorX == 0 )
+    {
+        insertRow(configuration.cursorY, "", 0);
+    }
+    else
+    {
+        textRow* row = editorRow(configuration.cursorY); // we trunchiate the current row into two and we move  one on the next line,
+        insertRow(configuration.cursorY + 1, &row->chars[configuration.cursorX], row->size - configuration.cursorX);
+        row = editorRow(configuration.cursorY); // we reinitialize our pointer and cut the row where the cursor was
+        rowDeleteText(row, configuration.cursorX, row->size - configuration.cursorX);
+    }
+    configuration.cursorY ++;
+    configuration.cursorX = 0;
+}
+
+void insertChar(int c)
+{
+    if( configuration.cursorY == configuration.rows_number )
+        loadRest();
+    if( configuration.cursorY == configuration.rows_number )
+        insertRow(configuration.rows_number, "", 0);   // in case we are at the end of our file.
+    rowInsertChar(editorRow(configuration.cursorY), configuration.cursorX, c);
+    configuration.cursorX++;
+}
+
+void deleteChar()
+{
+    if( configuration.cursorY == configuration.rows_number )
+        return;
+    if( configuration.cursorX == 0 && configuration.cursorY == 0 )
+        return;
+    if( configuration.cursorX > 0 )
+    {
+        rowDeleteChar(editorRow(configuration.cursorY), configuration.cursorX - 1);
+        configuration.cursorX --;
+    }
+    else
+    {
+        gapCommit(); // the row is appended to the previous one as a plain string
+        textRow* prev = editorRow(configuration.cursorY - 1); // this one first, it may move the window
+        textRow* row = editorRow(configuration.cursorY);
+        configuration.cursorX = prev->size;
+        rowAppendString(prev, row->chars, row->size);
+        deleteRow(configuration.cursorY);
+        configuration.cursorY --;
+    }
+}
+
+/*** Undo ***/
+
+/*
+Every change of the document is recorded by the row functions as one of four operations: text inserted into a row, text
+deleted from a row, a row inserted, a row deleted. The operations are written one after the other into a single byte log:
+
+    [ header | the text | size of the whole record ] [ header | ... ] ...
+
+The size at the end lets undo walk the log backwards. Everything in front of undo.pos is done, everything after it can be
+redone, and a new edit throws the redo part away. An operation carries its text, so undoing or redoing it costs O(its size).
+
+All the operations of one keypress form a group which is undone at once ( Enter is a row insert plus a delete, replace all
+can be thousands of operations ). Keys which were already waiting when they were read ( a paste ) join the group of the key
+before them, so a pasted block is one undo step. Typing and deleting characters next to each other is merged into the
+previous record, up to LEAF_UNDO_COALESCE bytes, instead of adding a record per key.
+
+When the log outgrows LEAF_UNDO_MAX bytes the oldest quarter of it is dropped.
+*/
+
+struct undoRecord{
+    unsigned char type;
+    unsigned char group_start; // 1 for the first record of a group
+    int row;
+    int col;
+    int len;  // bytes of text following the header
+};
+
+int undoRecordSize(int len)
+{
+    return sizeof(struct undoRecord) + len + sizeof(int);
+}
+
+void undoReadRecord(int at, struct undoRecord* record)
+{
+    memcpy(record, &configuration.undo.log[at], sizeof(struct undoRecord)); // the log is a byte array, records aren't aligned
+}
+
+void undoWriteRecord(int at, const struct undoRecord* record)
+{
+    memcpy(&configuration.undo.log[at], record, sizeof(struct undoRecord));
+    int size = undoRecordSize(record->len);
+    memcpy(&configuration.undo.log[at + size - sizeof(int)], &size, sizeof(int));
+}
+
+void undoReserve(int extra)
+{
+    struct undoLog* undo = &configuration.undo;
+    if( undo->used + extra <= undo->capacity )
+        return;
+    while( undo->capacity < undo->used + extra )
+        undo->capacity = undo->capacity ? undo->capacity * 2 : 4096;
+    undo->log = realloc(undo->log, undo->capacity);
+}
+
+void undoTrim()
+{
+    /* drops whole groups from the front until a quarter of the log is gone */
+    struct undoLog* undo = &configuration.undo;
+    int cut = 0;
+    struct undoRecord record;
+    while( cut < undo->pos )
+    {
+        undoReadRecord(cut, &record);
+        if( record.group_start && cut >= undo->used / 4 )
+            break;
+        cut += undoRecordSize(record.len);
+    }
+    memmove(undo->log, &undo->log[cut], undo->used - cut);
+    undo->used -= cut;
+    undo->pos -= cut;
+    undo->base += cut;
+    undo->last = -1; // the record we were merging into may be gone
+}
+
+void undoForget()
+{
+    /* drops the whole history, for when the rows it names went away without being edits ( lines dropped while following ) */
+    struct undoLog* undo = &configuration.undo;
+    int clean = ( undo->saved == undo->base + undo->pos );
+    undo->base += undo->used;
+    undo->used = 0;
+    undo->pos = 0;
+    undo->last = -1;
+    undo->saved = clean ? undo->base : -1;
+    undo->synced = -1;
+    undo->new_group = 1;
+}
+
+void undoKeypress(int waiting)
+{
+    /* called for every key the editor processes, a key that was already waiting ( pasted ) continues the current group */
+    struct undoLog* undo = &configuration.undo;
+    undo->key ++;
+    if( !waiting )
+        undo->new_group = 1;
+}
+
+void undoRecordEdit(int type, int row, int col, const char* text, int len)
+{
+    struct undoLog* undo = &configuration.undo;
+    lineOffsetsChanged(row); // the rows after this one start at different bytes now
+    if( configuration.follow.appending ) // lines the followed file grew by are not edits
+        return;
+    journalAppend(type, row, col, text, len); // the crash journal wants every edit, also the ones undo and redo make
+    if( undo->replaying )
+        return;
+    if( undo->pos < undo->used ) // a new edit after some undos, the redo part is gone for good
+    {
+        undo->used = undo->pos;
+        if( undo->synced > undo->base + undo->used )
+            undo->synced = undo->base + undo->used;
+        undo->last = -1;
+        if( undo->saved > undo->base + undo->pos )
+            undo->saved = -1;
+    }
+
+    struct undoRecord record;
+    if( undo->last != -1 && undo->last_key >= undo->key - 1 && ( type == UNDO_INSERT_TEXT || type == UNDO_DELETE_TEXT ) )
+    {
+        undoReadRecord(undo->last, &record);
+        int append = ( type == UNDO_INSERT_TEXT ) ? ( col == record.col + record.len ) : ( col == record.col );
+        int prepend = ( type == UNDO_DELETE_TEXT && col + len == record.col );
+        if( record.type == type && record.row == row && ( append || prepend ) && record.len + len <= LEAF_UNDO_COALESCE )
+        {
+            // typing ( or deleting ) next to the previous record just makes that record longer
+            undoReserve(len);
+            if( undo->synced > undo->base + undo->last ) // the sidecar has the record as it was, it is written again
+                undo->synced = undo->base + undo->last;
+            char* text_at = &undo->log[undo->last + sizeof(struct undoRecord)];
+            if( append )
+                memcpy(text_at + record.len, text, len);
+            else
+            {
+                memmove(text_at + len, text_at, record.len);
+                memcpy(text_at, text, len);
+                record.col = col;
+            }
+            record.len += len;
+            undoWriteRecord(undo->last, &record);
+            undo->used = undo->pos = undo->last + undoRecordSize(record.len);
+            undo->last_key = undo->key;
+            undo->new_group = 0;
+            return;
+        }
+    }
+
+    record.type = type;
+    record.group_start = undo->new_group;
+    record.row = row;
+    record.col = col;
+    record.len = len;
+    undoReserve(undoRecordSize(len));
+    undo->last = undo->used;
+    memcpy(&undo->log[undo->used + sizeof(struct undoRecord)], text, len);
+    undoWriteRecord(undo->used, &record);
+    undo->used = undo->pos = undo->used + undoRecordSize(len);
+    undo->last_key = undo->key;
+    undo->new_group = 0;
+    if( undo->used > LEAF_UNDO_MAX )
+        undoTrim();
+}
+
+void undoApply(const struct undoRecord* record, const char* text, int forward)
+{
+    /* redoes ( forward ) or reverts one record and puts the cursor where it happened */
+    int type = record->type;
+    if( !forward ) // reverting a operation is doing the opposite one
+        type = ( type == UNDO_INSERT_TEXT ) ? UNDO_DELETE_TEXT : ( type == UNDO_DELETE_TEXT ) ? UNDO_INSERT_TEXT :
+               ( type == UNDO_INSERT_ROW ) ? UNDO_DELETE_ROW : UNDO_INSERT_ROW;
+    configuration.cursorY = record->row;
+    configuration.cursorX = record->col;
+    switch( type )
+    {
+        case UNDO_INSERT_TEXT:
+            rowInsertText(editorRow(record->row), record->col, text, record->len);
+            configuration.cursorX += record->len;
+            break;
+        case UNDO_DELETE_TEXT:
+            rowDeleteText(editorRow(record->row), record->col, record->len);
+            break;
+        case UNDO_INSERT_ROW:
+            insertRow(record->row, (char*)text, record->len);
+            break;
+        case UNDO_DELETE_ROW:
+            deleteRow(record->row);
+            break;
+    }
+}
+
+void undoStep(int forward)
+{
+    struct undoLog* undo = &configuration.undo;
+    if( forward ? undo->pos == undo->used : undo->pos == 0 )
+    {
+        setStatusMessage(forward ? "Nothing to redo" : "Nothing to undo");
+        return;
+    }
+    gapCommit();
+    undo->replaying = 1;
+    struct undoRecord record;
+    do
+    {
+        int at;
+        if( forward )
+            at = undo->pos;
+        else
+        {
+            int size;
+            memcpy(&size, &undo->log[undo->pos - sizeof(int)], sizeof(int));
+            at = undo->pos - size;
+        }
+        undoReadRecord(at, &record);
+        undoApply(&record, &undo->log[at + sizeof(struct undoRecord)], forward);
+        undo->pos = forward ? at + undoRecordSize(record.len) : at;
+        if( forward && undo->pos < undo->used )
+            undoReadRecord(undo->pos, &record); // a redo stops in front of the next group
+    } while( forward ? ( undo->pos < undo->used && !record.group_start ) : !record.group_start );
+    undo->replaying = 0;
+    undo->last = -1;        // nothing merges into a record that was undone or redone
+    undo->new_group = 1;
+
+    if( configuration.cursorY > configuration.rows_number )
+        configuration.cursorY = configuration.rows_number;
+    int size = ( configuration.cursorY < configuration.rows_number ) ? editorRow(configuration.cursorY)->size : 0;
+    if( configuration.cursorX > size )
+        configuration.cursorX = size;
+    configuration.dirty = ( undo->base + undo->pos != undo->saved ); // back at the saved state means nothing to save
+}
+
+/*
+The history also survives restarting the editor. Saving appends what the log gained since the last save to a sidecar file
+next to the document ( "name" LEAF_UNDO_SIDECAR ) as one segment:
+
+    [ segment header | the log bytes from header.start on ] [ segment header | ... ] ...
+
+A segment says where its bytes go in the log ( start, counted like base + offset ), so after some undos and a new edit the
+next segment simply starts earlier and overwrites the old redo part, the file is never rewritten for that. It is rewritten
+from scratch when it belongs to something else, when the part of the log it misses was already trimmed, or when the dead
+segments make it more than twice the size of the log.
+
+Every segment ends with the position undo was at and the hash of the file as it was saved. editorOpen() adopts the history
+only if the hash of the last complete segment matches the file it just read, a file changed by anything else starts with an
+empty history. The records are stored in the byte order of the machine, the sidecar is a cache and not a exchange format.
+*/
+
+struct undoSegment{
+    char magic[4];              // "LUS1"
+    int length;                 // bytes of log following the header
+    long long start;
+    long long pos;              // base + pos at the time of the save
+    unsigned long long hash;    // of the saved file
+};
+
+char* undoSidecarName(const char* filename)
+{
+    size_t len = strlen(filename) + sizeof(LEAF_UNDO_SIDECAR);
+    char* name = malloc(len);
+    snprintf(name, len, "%s" LEAF_UNDO_SIDECAR, filename);
+    return name;
+}
+
+void undoSaveSidecar(unsigned long long hash)
+{
+    struct undoLog* undo = &configuration.undo;
+    char* name = undoSidecarName(configuration.filename);
+    if( undo->base + undo->used == 0 ) // nothing was ever edited, a old history doesn't match the file anymore
+    {
+        if( undo->synced != 0 )
+            unlink(name);
+        undo->synced = 0;
+        free(name);
+        return;
+    }
+    int flags = O_WRONLY | O_CREAT | O_APPEND;
+    long long start = undo->synced;
+    if( start < undo->base || start > undo->base + undo->used || undo->sidecar_bytes > 2LL * LEAF_UNDO_MAX )
+    {
+        start = undo->base;
+        flags |= O_TRUNC;
+        undo->sidecar_bytes = 0;
+    }
+    struct undoSegment segment = { {'L', 'U', 'S', '1'}, undo->base + undo->used - start, start, undo->base + undo->pos, hash };
+    int fd = open(name, flags, 0600); // it holds text of the document, deleted text included, so it is as private as the journal
+    free(name);
+    if( fd != -1 )
+        fchmod(fd, 0600); // a sidecar written before with wider permissions
+    if( fd != -1 && writeAll(fd, (char*)&segment, sizeof(segment)) == 0 &&
+        writeAll(fd, &undo->log[start - undo->base], segment.length) == 0 )
+    {
+        undo->synced = undo->base + undo->used;
+        undo->sidecar_bytes += sizeof(segment) + segment.length;
+    }
+    else
+        undo->synced = -1; // a half written segment is ignored when it's read, the next save starts over
+    if( fd != -1 )
+        close(fd);
+}
+
+void undoLoadSidecar(unsigned long long hash)
+{
+    /* rebuilds the log from the segments of the sidecar, if the last of them was written together with this very file */
+    struct undoLog* undo = &configuration.undo;
+    char* name = undoSidecarName(configuration.filename);
+    FILE* fp = fopen(name, "r");
+    free(name);
+    if( fp == NULL )
+        return;
+    char* log = NULL;
+    long long base = 0, used = 0, pos = -1, bytes = 0;
+    int capacity = 0;
+    unsigned long long last_hash = 0;
+    struct undoSegment segment;
+    while( fread(&segment, sizeof(segment), 1, fp) == 1 && memcmp(segment.magic, "LUS1", 4) == 0 && segment.length >= 0 )
+    {
+        if( pos == -1 ) // the first segment is where the log starts
+            base = segment.start;
+        if( segment.start < base || segment.start > base + used || segment.start - base + segment.length > INT_MAX / 2 )
+            break;
+        used = segment.start - base;
+        if( used + segment.length > capacity )
+        {
+            capacity = used + segment.length;
+            log = realloc(log, capacity);
+        }
+        if( fread(&log[used], 1, segment.length, fp) != (size_t)segment.length )
+            break;
+        used += segment.length;
+        bytes += sizeof(segment) + segment.length;
+        if( segment.pos < base || segment.pos > base + used )
+            break;
+        pos = segment.pos - base;
+        last_hash = segment.hash;
+    }
+    fclose(fp);
+    if( pos == -1 || last_hash != hash || used > INT_MAX / 2 )
+    {
+        free(log);
+        return; // the file was changed without us, the sidecar gets rewritten on the next save
+    }
+    free(undo->log);
+    undo->log = log;
+    undo->capacity = capacity;
+    undo->used = used;
+    undo->pos = pos;
+    undo->base = base;
+    undo->saved = base + pos;
+    undo->last = -1;
+    undo->new_group = 1;
+    undo->synced = base + used;
+    undo->sidecar_bytes = bytes;
+    if( undo->used > LEAF_UNDO_MAX )
+        undoTrim();
+}
+
+/*** Journal ***/
+
+/*
+Unsaved edits survive a crash or a dropped connection through a journal next to the file ( "name" LEAF_JOURNAL_SUFFIX ). It
+starts with a header naming the exact file it applies to ( size, modification time and inode, so no hashing of big files ),
+followed by every edit as a undo record without the trailing size:
+
+    [ header ] [ record | text ] [ record | text ] ...
+
+undoRecordEdit() hands each edit to journalAppend(), undo and redo included, which only copies it into a memory buffer: a key
+costs a memcpy. The buffer is written out when it gets big, and written and fsync()ed when the editor is idle, at most every
+LEAF_JOURNAL_SYNC_MS. die() and SIGHUP / SIGTERM write out what is still buffered.
+
+Saving starts a fresh journal for the new file, quitting deletes it. When a file is opened and its journal names it, the
+records are replayed as normal edits ( they can be undone ) and the journal is kept and appended to. A torn record at the end
+is cut off.
+*/
+
+struct journalHeader{
+    char magic[4];      // "LJR1"
+    int reserved;
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    long long inode;
+};
+
+void journalHeaderOf(const char* filename, struct journalHeader* header)
+{
+    struct stat st;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, "LJR1", 4);
+    if( stat(filename, &st) == 0 )
+    {
+        header->size = st.st_size;
+        header->mtime_sec = st.st_mtim.tv_sec;
+        header->mtime_nsec = st.st_mtim.tv_nsec;
+        header->inode = st.st_ino;
+    }
+}
+
+char* journalName(const char* filename)
+{
+    size_t len = strlen(filename) + sizeof(LEAF_JOURNAL_SUFFIX);
+    char* name = malloc(len);
+    snprintf(name, len, "%s" LEAF_JOURNAL_SUFFIX, filename);
+    return name;
+}
+
+void journalFlush()
+{
+    /* write() only, the data is safe from a crash of the editor but not yet from one of the machine */
+    struct journal* journal = &configuration.journal;
+    if( journal->fd == -1 || journal->pending == 0 )
+        return;
+    if( writeAll(journal->fd, journal->buffer, journal->pending) == 0 )
+        journal->unsynced = 1;
+    journal->pending = 0; // if the disk is full there is nothing better to do than to drop it
+}
+
+void journalTick()
+{
+    struct journal* journal = &configuration.journal;
+    journalFlush();
+    long long now = monotonicMs();
+    if( journal->unsynced && now - journal->synced_at >= LEAF_JOURNAL_SYNC_MS )
+    {
+        fsync(journal->fd);
+        journal->unsynced = 0;
+        journal->synced_at = now;
+    }
+}
+
+void journalAppend(int type, int row, int col, const char* text, int len)
+{
+    struct journal* journal = &configuration.journal;
+    if( journal->fd == -1 )
+        return;
+    struct undoRecord record;
+    memset(&record, 0, sizeof(record)); // no stack garbage in the padding on disk
+    record.type = type;
+    record.row = row;
+    record.col = col;
+    record.len = len;
+    int need = journal->pending + sizeof(record) + len;
+    if( need > journal->capacity )
+    {
+        while( journal->capacity < need )
+            journal->capacity = journal->capacity ? journal->capacity * 2 : 4096;
+        journal->buffer = realloc(journal->buffer, journal->capacity);
+    }
+    memcpy(&journal->buffer[journal->pending], &record, sizeof(record));
+    memcpy(&journal->buffer[journal->pending + sizeof(record)], text, len);
+    journal->pending = need;
+    if( journal->pending >= LEAF_JOURNAL_FLUSH ) // a paste or replace all, don't keep megabytes only in memory
+        journalFlush();
+}
+
+void journalStart()
+{
+    /* truncates the journal and names the file as it is on disk now, called after every save */
+    struct journal* journal = &configuration.journal;
+    if( journal->fd != -1 )
+        close(journal->fd);
+    journal->fd = -1;
+    journal->pending = 0;
+    journal->unsynced = 0;
+    if( configuration.filename == NULL || journal->off ) // a headless run never touches the crash journal
+        return;
+    struct journalHeader header;
+    journalHeaderOf(configuration.filename, &header);
+    char* name = journalName(configuration.filename);
+    journal->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    free(name);
+    if( journal->fd != -1 && writeAll(journal->fd, (char*)&header, sizeof(header)) == -1 )
+    {
+        close(journal->fd);
+        journal->fd = -1;
+    }
+}
+
+void journalRestamp()
+{
+    /* the followed file grew and the document with it: the header names the file as it is now, the records still fit it */
+    struct journal* journal = &configuration.journal;
+    if( journal->fd == -1 )
+        return;
+    struct journalHeader header;
+    journalHeaderOf(configuration.filename, &header);
+    if( pwrite(journal->fd, &header, sizeof(header), 0) == sizeof(header) ) // pwrite() leaves the offset at the end
+        journal->unsynced = 1;
+}
+
+int journalRecordValid(const struct undoRecord* record)
+{
+    /* a record must fit the document as the records before it left it, otherwise the journal is not ours or is torn */
+    int rows = configuration.rows_number;
+    if( record->len < 0 || record->row < 0 || record->col < 0 )
+        return 0;
+    switch( record->type )
+    {
+        case UNDO_INSERT_ROW:
+            return record->row <= rows && record->col == 0;
+        case UNDO_DELETE_ROW:
+            return record->row < rows && record->col == 0 && editorRow(record->row)->size == record->len;
+        case UNDO_INSERT_TEXT:
+            return record->row < rows && record->col <= editorRow(record->row)->size;
+        case UNDO_DELETE_TEXT:
+            return record->row < rows && record->col + (long long)record->len <= editorRow(record->row)->size;
+    }
+    return 0;
+}
+
+void journalOpen()
+{
+    /* called once the file is loaded: replays a journal left behind by a editor that didn't quit, then keeps journaling */
+    if( configuration.journal.off )
+        return;
+    char* name = journalName(configuration.filename);
+    FILE* fp = fopen(name, "r");
+    struct journalHeader header, expected;
+    journalHeaderOf(configuration.filename, &expected);
+    long long valid = sizeof(header);
+    int recovered = 0;
+    if( fp != NULL && fread(&header, sizeof(header), 1, fp) == 1 && memcmp(&header, &expected, sizeof(header)) == 0 )
+    {
+        struct undoRecord record;
+        char* text = NULL;
+        int capacity = 0;
+        while( fread(&record, sizeof(record), 1, fp) == 1 && journalRecordValid(&record) )
+        {
+            if( record.len > capacity )
+            {
+                capacity = record.len;
+                text = realloc(text, capacity);
+            }
+            if( fread(text, 1, record.len, fp) != (size_t)record.len )
+                break;
+            if( record.type == UNDO_DELETE_ROW && memcmp(editorRow(record.row)->chars, text, record.len) != 0 )
+                break;
+            undoApply(&record, text, 1);
+            valid += sizeof(record) + record.len;
+            recovered ++;
+        }
+        free(text);
+    }
+    if( fp != NULL )
+        fclose(fp);
+
+    if( recovered == 0 )
+    {
+        free(name);
+        journalStart();
+        return;
+    }
+    configuration.journal.fd = open(name, O_WRONLY);
+    free(name);
+    if( configuration.journal.fd == -1 || ftruncate(configuration.journal.fd, valid) == -1 ||
+        lseek(configuration.journal.fd, valid, SEEK_SET) == -1 )
+        journalStart();
+    configuration.dirty = recovered; // the cursor stays at the last recovered edit
+    setStatusMessage("Recovered %d unsaved edits from the journal, Ctrl-Z undoes them", recovered);
+}
+
+void journalDiscard()
+{
+    /* the user quit without saving, so the edits are meant to be lost, or the journal can no longer describe the document */
+    struct journal* journal = &configuration.journal;
+    if( journal->fd == -1 )
+        return;
+    close(journal->fd);
+    journal->fd = -1;
+    char* name = journalName(configuration.filename);
+    unlink(name);
+    free(name);
+}
+
+void journalSignal(int sig)
+{
+    /* the terminal went away ( SIGHUP ) or we were asked to stop, what is buffered goes to the journal first */
+    struct journal* journal = &configuration.journal;
+    if( journal->fd != -1 && journal->pending > 0 )
+        writeAll(journal->fd, journal->buffer, journal->pending);
+    _exit(128 + sig);
+}
+
+/*** File I/O ***/
+
+char* rowsToString( size_t* bufferLength )
+{
+    /*
+    Joins all rows from the editor configuration into a single character buffer, separated by newline characters. 
+    The function returns the buffer and stores its length in *bufferLength.
+    The returned buffer:
+     - Contains exactly the row data + one '\n' per row.
+     - Is NOT null-terminated.
+     - Must be freed by the caller after use.*/
+    gapCommit();
+    size_t totalLength = 0;
+    for( int i = 0; i < configuration.rows_number; i ++ )
+    {
+        totalLength += configuration.row[i].size + 1;
+    }
+    *bufferLength = totalLength;
+
+    char* buffer = malloc(totalLength);
+    char* aux = buffer;
+    for( int i = 0; i < configuration.rows_number; i ++ )
+    {
+        memcpy(aux, configuration.row[i].chars, configuration.row[i].size);//we copy in the auxiliary buffer the line
+        aux += configuration.row[i].size; // we move the pointer with the size of the new sentence
+        *aux = '\n';// we add the '\n' character where the auxiliary pointer points
+        aux ++; // we move on and prepare for the next line
+    }
+
+    return buffer;
+}
+
+/*
+Compressed files ( rotated logs mostly ) are opened and saved through a FILE* that compresses or decompresses on the fly, made
+with fopencookie(). Everything else sees a plain stream: the progressive loader reads lines from it with getline() in its idle
+slices, so a big .gz is decompressed a slice at a time while the user already looks at the first screen, and only the text
+ever is in memory, never the whole compressed file next to it. Saving streams the rows into the compressor and the compressed
+bytes go straight to a temporary file, which is renamed over the original once it is complete.
+
+What a file is comes from its first bytes, a new file goes by its name. A rope needs to map the text itself, so a compressed file
+always opens in row mode, and following it makes no sense: appending to a .gz adds compressed bytes, not lines.
+*/
+
+int compressionOf(const char* filename)
+{
+    unsigned char magic[4];
+    int fd = open(filename, O_RDONLY);
+    if( fd != -1 )
+    {
+        ssize_t got = read(fd, magic, sizeof(magic));
+        close(fd);
+        if( got >= 2 && magic[0] == 0x1f && magic[1] == 0x8b )
+            return COMPRESSION_GZIP;
+        if( got == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd )
+            return COMPRESSION_ZSTD;
+        if( got > 0 )
+            return COMPRESSION_NONE;
+    }
+    size_t len = strlen(filename); // no file yet, or a empty one
+    if( len > 3 && !strcmp(filename + len - 3, ".gz") )
+        return COMPRESSION_GZIP;
+#ifdef LEAF_ZSTD
+    if( len > 4 && !strcmp(filename + len - 4, ".zst") )
+        return COMPRESSION_ZSTD;
+#endif
+    return COMPRESSION_NONE;
+}
+
+ssize_t compressedRead(void* cookie, char* buffer, size_t size)
+{
+    /* the end of the file in the middle of a stream is a error, or a truncated file would look complete and be saved cut */
+    struct compressedFile* file = cookie;
+    if( file->compression == COMPRESSION_GZIP )
+    {
+        int got = gzread(file->gz, buffer, size > INT_MAX ? INT_MAX : size);
+        int error = Z_OK;
+        if( got == 0 )
+            gzerror(file->gz, &error);
+        if( error == Z_BUF_ERROR )
+        {
+            errno = EIO;
+            return -1;
+        }
+        return got;
+    }
+#ifdef LEAF_ZSTD
+    ZSTD_outBuffer out = { buffer, size, 0 };
+    while( out.pos == 0 )
+    {
+        if( file->in.pos == file->in.size )
+        {
+            file->in.size = fread(file->buffer, 1, LEAF_COMPRESS_CHUNK, file->raw);
+            file->in.pos = 0;
+            if( file->in.size == 0 && ( ferror(file->raw) || file->left > 0 ) )
+            {
+                errno = EIO;
+                return -1;
+            }
+            if( file->in.size == 0 )
+                return 0;
+        }
+        file->left = ZSTD_decompressStream(file->dctx, &out, &file->in);
+        if( ZSTD_isError(file->left) )
+        {
+            errno = EIO;
+            return -1;
+        }
+    }
+    return out.pos;
+#else
+    return -1;
+#endif
+}
+
+ssize_t compressedWrite(void* cookie, const char* buffer, size_t size)
+{
+    struct compressedFile* file = cookie;
+    if( file->compression == COMPRESSION_GZIP )
+        return gzwrite(file->gz, buffer, size > INT_MAX ? INT_MAX : size) == 0 ? -1 : (ssize_t)size;
+#ifdef LEAF_ZSTD
+    ZSTD_inBuffer in = { buffer, size, 0 };
+    while( in.pos < in.size )
+    {
+        ZSTD_outBuffer out = { file->buffer, LEAF_COMPRESS_CHUNK, 0 };
+        if( ZSTD_isError(ZSTD_compressStream2(file->cctx, &out, &in, ZSTD_e_continue)) ||
+            fwrite(file->buffer, 1, out.pos, file->raw) != out.pos )
+            return -1;
+    }
+    return size;
+#else
+    return -1;
+#endif
+}
+
+int compressedClose(void* cookie)
+{
+    /* finishes the stream when writing, a error here means the file is incomplete */
+    struct compressedFile* file = cookie;
+    int result = 0;
+    if( file->compression == COMPRESSION_GZIP )
+        result = gzclose(file->gz) == Z_OK ? 0 : -1;
+#ifdef LEAF_ZSTD
+    else
+    {
+        if( file->cctx )
+        {
+            size_t left;
+            do
+            {
+                ZSTD_outBuffer out = { file->buffer, LEAF_COMPRESS_CHUNK, 0 };
+                ZSTD_inBuffer in = { NULL, 0, 0 };
+                left = ZSTD_compressStream2(file->cctx, &out, &in, ZSTD_e_end);
+                if( ZSTD_isError(left) || fwrite(file->buffer, 1, out.pos, file->raw) != out.pos )
+                {
+                    result = -1;
+                    break;
+                }
+            } while( left > 0 );
+        }
+        ZSTD_freeDCtx(file->dctx);
+        ZSTD_freeCCtx(file->cctx);
+        free(file->buffer);
+        if( fclose(file->raw) != 0 )
+            result = -1;
+    }
+#endif
+    free(file);
+    return result;
+}
+
+FILE* compressedOpen(int fd, int compression, const char* mode)
+{
+    /* a stream over fd ( which it owns from now on ) that hides the compression, "r" or "w" */
+    if( fd == -1 )
+        return NULL;
+    if( compression == COMPRESSION_NONE )
+        return fdopen(fd, mode);
+    struct compressedFile* file = calloc(1, sizeof(struct compressedFile));
+    file->compression = compression;
+    int opened = 0;
+    if( compression == COMPRESSION_GZIP )
+        opened = ( file->gz = gzdopen(fd, mode[0] == 'w' ? "wb" : "rb") ) != NULL;
+#ifdef LEAF_ZSTD
+    else if( ( file->raw = fdopen(fd, mode) ) != NULL )
+    {
+        opened = 1;
+        file->buffer = malloc(LEAF_COMPRESS_CHUNK);
+        if( mode[0] == 'w' )
+        {
+            file->cctx = ZSTD_createCCtx();
+            ZSTD_CCtx_setParameter(file->cctx, ZSTD_c_compressionLevel, LEAF_ZSTD_LEVEL);
+        }
+        else
+        {
+            file->dctx = ZSTD_createDCtx();
+            file->in.src = file->buffer;
+        }
     }
+#else
     else
+        errno = ENOTSUP; // leaf was built without zstd ( make ZSTD=1 )
+#endif
+    if( !opened )
     {
-        configuration.cursorX = configuration.row[configuration.cursorY - 1].size;
-        rowAppendString(&configuration.row[configuration.cursorY - 1], row->chars, row->size);
-        deleteRow(configuration.cursorY);
-        configuration.cursorY --;
+        close(fd);
+        free(file);
+        return NULL;
     }
+    cookie_io_functions_t functions = { compressedRead, compressedWrite, NULL, compressedClose };
+    return fopencookie(file, mode, functions);
 }
 
-/*** File I/O ***/
-
-char* rowsToString( int* bufferLength )
+int compressedSave(size_t* length, unsigned long long* hash)
 {
-    /*
-    Joins all rows from the editor configuration into a single character buffer, separated by newline characters. 
-    The function returns the buffer and stores its length in *bufferLength.
-    The returned buffer:
-     - Contains exactly the row data + one '\n' per row.
-     - Is NOT null-terminated.
-     - Must be freed by the caller after use.*/
-    int totalLength = 0;
-    for( int i = 0; i < configuration.rows_number; i ++ )
+    /* writes the rows compressed to a temporary file and renames it over the file, -1 with errno set if that failed */
+    size_t name_len = strlen(configuration.filename) + 8;
+    char* temporary = malloc(name_len);
+    snprintf(temporary, name_len, "%s.leaf~", configuration.filename);
+    struct stat st;
+    mode_t mode = ( stat(configuration.filename, &st) == 0 ) ? ( st.st_mode & 0777 ) : 0644;
+
+    int result = -1;
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if( fd != -1 )
     {
-        totalLength += configuration.row[i].size + 1;
+        FILE* fp = compressedOpen(dup(fd), configuration.compression, "w"); // closing the stream closes the copy, fd stays to fsync
+        if( fp )
+        {
+            *length = 0;
+            *hash = LEAF_FNV_SEED;
+            gapCommit();
+            for( int i = 0; i < configuration.rows_number; i ++ )
+            {
+                textRow* row = &configuration.row[i];
+                fwrite(row->chars, 1, row->size, fp);
+                fputc('\n', fp);
+                *hash = fnvHash(fnvHash(*hash, row->chars, row->size), "\n", 1);
+                *length += row->size + 1;
+            }
+            int failed = ferror(fp);
+            if( fclose(fp) == 0 && !failed && fsync(fd) == 0 )
+                result = 0;
+        }
+        if( close(fd) != 0 )
+            result = -1;
+        if( result == 0 && rename(temporary, configuration.filename) != 0 )
+            result = -1;
+        if( result == -1 )
+        {
+            int saved_errno = errno;
+            unlink(temporary);
+            errno = saved_errno;
+        }
     }
-    *bufferLength = totalLength;
+    free(temporary);
+    return result;
+}
 
-    char* buffer = malloc(totalLength);
-    char* aux = buffer;
-    for( int i = 0; i < configuration.rows_number; i ++ )
+/*
+A big file used to be read whole before the first screen was drawn. Now editorOpen() reads only what fits in one idle slice,
+draws the screen, and the rest of the lines are appended by editorIdle() while no key is waiting, a slice at a time. The status
+bar counts the lines as they arrive. The loaded rows can be edited right away: the file only ever adds rows after the last one,
+so the row numbers undo and the journal record stay the rows of the whole file.
+
+Everything that needs the whole document first calls loadRest(): saving ( the file is still being read ), searching and
+replacing. The cursor stops at the last loaded row, and typing on the row after it ( the file may have no rows loaded yet )
+loads the rest first. An undo history or a journal left for the file is about all of it, so then the file is read at once like before.
+*/
+
+void loadDone()
+{
+    struct fileLoader* loader = &configuration.loader;
+    free(loader->line);
+    loader->line = NULL;
+    loader->capacity = 0;
+    loader->failed = ferror(loader->fp);
+    if( loader->failed )
+        setStatusMessage("Only %lld bytes could be read, the file is damaged or truncated", loader->bytes);
+    fclose(loader->fp);
+    loader->fp = NULL;
+    followMark(loader->bytes);
+    if( loader->bytes >= LEAF_TRIGRAM_MIN_BYTES )
+        trigramEnable(); // the search index is built in the background while the user looks at the file
+}
+
+void loadRows(long long deadline)
+{
+    /* appends the next lines of the file as rows until the deadline passes, they are not edits: no undo, no journal, not dirty */
+    long long trace_start = traceBegin();
+    struct fileLoader* loader = &configuration.loader;
+    long long highlight_us = configuration.latency.highlight_us; // highlighting loaded rows is not the next key's latency
+    ssize_t length;
+    int count = 0;
+    while( (length = getline(&loader->line, &loader->capacity, loader->fp)) != -1 )
     {
-        memcpy(aux, configuration.row[i].chars, configuration.row[i].size);//we copy in the auxiliary buffer the line
-        aux += configuration.row[i].size; // we move the pointer with the size of the new sentence
-        *aux = '\n';// we add the '\n' character where the auxiliary pointer points
-        aux ++; // we move on and prepare for the next line
+        loader->hash = fnvHash(loader->hash, loader->line, length);
+        loader->bytes += length;
+        while( length > 0 && ( loader->line[length - 1] == '\n' || loader->line[length - 1] == '\r' ) )
+            length --;
+
+        int at = configuration.rows_number;
+        configuration.row = realloc(configuration.row, sizeof(textRow) * ( at + 1 ));
+        textRow* row = &configuration.row[at];
+        initRow(row, at, length);
+        memcpy(row->chars, loader->line, length);
+        configuration.rows_number ++;
+        configuration.win_rows ++;
+        trigramRowInserted(at);
+        UpdateRow(row);
+
+        if( ( ++ count & 255 ) == 0 && monotonicMs() >= deadline )
+            break;
     }
+    if( length == -1 )
+        loadDone();
+    configuration.latency.highlight_us = highlight_us;
+    traceEnd("loadRows", trace_start);
+}
 
-    return buffer;
+void loadRest()
+{
+    if( configuration.loader.fp )
+        loadRows(LLONG_MAX);
 }
 
 void editorOpen(char* filename)
 {
+    long long trace_start = traceBegin();
     free(configuration.filename);
     configuration.filename = strdup(filename); //It makes a copy of the given string, allocating the required memory and assuming you will free() that memory.
     
     selectSyntaxHighlight();
 
-    FILE* fp = fopen(filename, "r");
+    configuration.compression = compressionOf(filename);
+    FILE* fp = compressedOpen(open(filename, O_RDONLY), configuration.compression, "r");
     if(!fp) die("fopen");
 
-    char* line = NULL;
-    size_t capacity = 0;
-    ssize_t length;
+    struct fileLoader* loader = &configuration.loader;
+    struct stat st;
+    loader->fp = fp;
+    loader->bytes = 0;
+    loader->size = ( configuration.compression == COMPRESSION_NONE && stat(filename, &st) == 0 ) ? st.st_size : 0; // the text of a compressed one is bigger
+    loader->hash = LEAF_FNV_SEED;
+    loader->shown_at = 0;
+
+    char* sidecar = undoSidecarName(filename);
+    char* journal = journalName(filename);
+    int history = ( access(sidecar, F_OK) == 0 || access(journal, F_OK) == 0 );
+    free(sidecar);
+    free(journal);
+    loadRows(history ? LLONG_MAX : monotonicMs() + LEAF_IDLE_SLICE_MS);
+
+    if( loader->fp == NULL ) // a history can only be matched against the whole file
+        undoLoadSidecar(loader->hash);
+    configuration.dirty = 0; //to reset the dirty flag
+    journalOpen();
+    traceEnd("editorOpen", trace_start);
+}
+
+void editorOpenRope(char* filename)
+{
+    /* opens the file as a rope, only the rows around the cursor are ever turned into textRow structs */
+    long long trace_start = traceBegin();
+    free(configuration.filename);
+    configuration.filename = strdup(filename);
+    selectSyntaxHighlight();
+
+    configuration.rope = ropeOpen(filename);
+    if( configuration.rope == NULL )
+        die("ropeOpen");
+    long long rows = ropeRows(configuration.rope);
+    if( rows > INT_MAX || configuration.rope->longest_line > INT_MAX / 2 ) // rows and columns are still ints in the editor
+    {
+        errno = EFBIG;
+        die("ropeOpen");
+    }
+    configuration.rows_number = rows;
+    ropeLoadWindow(0);
+    followMark(configuration.rope->map_len);
+    char* sidecar = undoSidecarName(filename);
+    if( access(sidecar, F_OK) == 0 ) // hashing the mapping reads the whole file, so only when there is a history to match
+        undoLoadSidecar(fnvHash(LEAF_FNV_SEED, configuration.rope->map, configuration.rope->map_len));
+    free(sidecar);
+    configuration.dirty = 0;
+    journalOpen();
+    traceEnd("editorOpenRope", trace_start);
+}
+
+void ropeSaveToFile()
+{
+    /*
+    The leaves that were never edited still point into the mapping of the file we are replacing, so the rope can't be written
+    over it in place. It goes to a temporary file next to it which is then renamed over the original, the old inode stays
+    alive ( and mapped ) for as long as the rope needs it.
+    */
+    size_t name_len = strlen(configuration.filename) + 8;
+    char* temporary = malloc(name_len);
+    snprintf(temporary, name_len, "%s.leaf~", configuration.filename);
+    struct stat st;
+    mode_t mode = ( stat(configuration.filename, &st) == 0 ) ? ( st.st_mode & 0777 ) : 0644;
+
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    unsigned long long hash = LEAF_FNV_SEED;
+    if( fd != -1 )
+    {
+        if( ropeWriteRec(configuration.rope->root, 0, fd, &hash) == 0 && fsync(fd) == 0 && close(fd) == 0 )
+        {
+            if( rename(temporary, configuration.filename) == 0 )
+            {
+                free(temporary);
+                configuration.dirty = 0;
+                configuration.undo.saved = configuration.undo.base + configuration.undo.pos;
+                undoSaveSidecar(hash);
+                journalStart();
+                followMark(-1);
+                setStatusMessage("%lld bytes written to disk", configuration.rope->root->bytes);
+                return;
+            }
+        }
+        else
+            close(fd);
+        unlink(temporary);
+    }
+    free(temporary);
+    setStatusMessage("Saving failed. I/O error: %s", strerror(errno));
+}
+
+void saveToFile()
+{
+    if( configuration.filename == NULL )
+    {
+        configuration.filename = prompt("Save as: %s (ESC to cancel)", NULL);
+        if( configuration.filename == NULL )
+        {
+            setStatusMessage("Save aborted");
+            return;
+        }
+        selectSyntaxHighlight();
+        configuration.compression = compressionOf(configuration.filename); // save as log.gz compresses it
+    }
+    if( configuration.loader.failed )
+    {
+        setStatusMessage("The file couldn't be read whole, saving would cut it");
+        return;
+    }
+    if( configuration.follow.dropped )
+    {
+        setStatusMessage("%lld lines were dropped while following, saving would cut them from the file", configuration.follow.dropped);
+        return;
+    }
+    if( configuration.rope )
+    {
+        ropeSaveToFile();
+        return;
+    }
+    loadRest(); // the file is rewritten from the rows, so all of them have to be there
+    size_t length;
+    if( configuration.compression != COMPRESSION_NONE )
+    {
+        unsigned long long hash;
+        if( compressedSave(&length, &hash) == -1 )
+        {
+            setStatusMessage("Saving failed. I/O error: %s", strerror(errno));
+            return;
+        }
+        configuration.dirty = 0;
+        configuration.undo.saved = configuration.undo.base + configuration.undo.pos;
+        undoSaveSidecar(hash);
+        journalStart();
+        followMark(-1);
+        setStatusMessage("%zu bytes written to disk, compressed", length);
+        return;
+    }
+    char* buffer = rowsToString(&length);
+
+    int fd = open(configuration.filename, O_RDWR | O_CREAT, 0644 );  //flags needed by the open function
+    if( fd != -1 )
+    {
+        if( ftruncate(fd, length) != -1 ) // this sets the file size with the given dimension
+        {
+            if( writeAll(fd, buffer, length) == 0 ) // we added 3 layers of protection in case something fails.
+            {
+                close(fd);
+                configuration.dirty = 0; // we reset the flag if we save the file
+                configuration.undo.saved = configuration.undo.base + configuration.undo.pos; // undoing back to here makes the file clean again
+                undoSaveSidecar(fnvHash(LEAF_FNV_SEED, buffer, length));
+                journalStart();
+                followMark(-1);
+                free(buffer);
+                setStatusMessage("%zu bytes written to disk", length); // we send a mission acomplished message when we succesfully saved the file
+                return;
+            }
+        }
+        close(fd);
+    }
+    free(buffer);
+    setStatusMessage("Saving failed. I/O error: %s", strerror(errno));
+}
+
+/*** Follow ***/
+
+/*
+Follow mode ( --follow, or Ctrl-A to toggle it ) is for logs that keep growing while we look at them. The file is watched with
+inotify and the descriptor is polled together with the keyboard in inputFill(), so a write to the file wakes the editor like a
+key would. editorIdle() then reads only the bytes after follow.offset, the end of the file as the document knows it, and
+appends them:
+
+  - the text is split at newlines and added with insertRow(), a line without its newline yet stays open and the next bytes
+    are appended to its row. These are not edits: undo and the journal skip them and the file doesn't become dirty
+  - when the cursor was on the last line it moves down with the new lines, so the end of the log stays on the screen
+  - with --keep N at most about N rows are kept: once there are N/8 more, the oldest ones are dropped from the head in one
+    go. The undo history names rows by number, so it is forgotten then, and the document can no longer be saved over the file
+  - a file that got shorter was truncated ( copytruncate ) and is followed from its start again, a new file under the same
+    name ( rotation ) is watched and read instead: a rename or delete drops the watch and editorIdle() watches the name
+    again until a new file has it. In rope mode a truncated file stops following: the text nobody edited is read from the
+    mapping of the file, and truncating a mapped file takes that text away, so only a reload helps. Such logs want --rows
+  - the crash journal header is stamped with the file's new size whenever it grows, so edits made while following are
+    recovered. Once the document stops being the file plus edits ( rows dropped, the file truncated or replaced ) the
+    journal is deleted: its records couldn't be replayed on anything on disk
+*/
+
+void followMark(long long bytes)
+{
+    /* the document now holds the first bytes of the file ( all of it when bytes is -1 ), following goes on from there */
+    struct follow* follow = &configuration.follow;
+    if( configuration.filename == NULL )
+        return;
+    struct stat st;
+    char last = '\n';
+    int fd = open(configuration.filename, O_RDONLY);
+    if( fd != -1 && fstat(fd, &st) == 0 )
+    {
+        if( bytes < 0 )
+            bytes = st.st_size;
+        follow->inode = st.st_ino;
+        follow->size = st.st_size;
+        follow->mtime_sec = st.st_mtim.tv_sec;
+        follow->mtime_nsec = st.st_mtim.tv_nsec;
+        if( bytes > 0 && pread(fd, &last, 1, bytes - 1) != 1 )
+            last = '\n';
+    }
+    if( fd != -1 )
+        close(fd);
+    follow->offset = bytes < 0 ? 0 : bytes;
+    follow->open_line = ( last != '\n' );
+    if( follow->fd != -1 )
+        followWatch(); // saving a rope renames a new file over the old one, the watch has to move to it
+}
+
+void followWatch()
+{
+    struct follow* follow = &configuration.follow;
+    follow->watch = inotify_add_watch(follow->fd, configuration.filename, LEAF_FOLLOW_EVENTS);
+    if( follow->watch != -1 )
+        follow->changed = 1; // it may be a new file, or it grew while it wasn't watched
+}
+
+void followEvents()
+{
+    /* drains the inotify descriptor, the events only tell us to look at the file again */
+    struct follow* follow = &configuration.follow;
+    char events[4096];
+    ssize_t got;
+    while( ( got = read(follow->fd, events, sizeof(events)) ) > 0 )
+    {
+        for( ssize_t at = 0; at < got; )
+        {
+            struct inotify_event event;
+            memcpy(&event, &events[at], sizeof(event)); // the buffer holds them back to back, not aligned
+            if( event.wd == follow->watch && ( event.mask & ( IN_MOVE_SELF | IN_DELETE_SELF ) ) )
+            {
+                // rotated away ( or deleted ): the watch would stay on the old file, editorIdle() watches the name again
+                inotify_rm_watch(follow->fd, follow->watch);
+                follow->watch = -1;
+            }
+            else if( event.wd == follow->watch && ( event.mask & IN_IGNORED ) ) // one of an old watch must not clear the new one
+                follow->watch = -1;
+            at += sizeof(event) + event.len;
+        }
+    }
+    follow->changed = 1;
+}
+
+void followAppend(char* text, int len)
+{
+    struct follow* follow = &configuration.follow;
+    int dirty = configuration.dirty;
+    follow->appending = 1;
+    while( len > 0 )
+    {
+        char* newline = memchr(text, '\n', len);
+        int line_len = newline ? newline - text : len;
+        int keep = line_len;
+        if( newline && keep > 0 && text[keep - 1] == '\r' )
+            keep --;
+        if( follow->open_line && configuration.rows_number > 0 )
+        {
+            textRow* row = editorRow(configuration.rows_number - 1);
+            rowInsertText(row, row->size, text, keep);
+        }
+        else
+            insertRow(configuration.rows_number, text, keep);
+        follow->open_line = ( newline == NULL );
+        text += line_len + ( newline != NULL );
+        len -= line_len + ( newline != NULL );
+    }
+    follow->appending = 0;
+    configuration.dirty = dirty;
+}
+
+void dropHeadRows(int count)
+{
+    /* removes the first count rows at once, deleting them one by one would move all the others count times */
+    gapCommit();
+    configuration.tab_cache.row = -1;
+    configuration.rows_number -= count;
+    if( configuration.rope )
+        ropeDelete(configuration.rope, 0, ropeLineStart(configuration.rope, count));
+    else
+    {
+        for( int i = 0; i < count; i ++ )
+            freeRow(&configuration.row[i]);
+        memmove(configuration.row, &configuration.row[count], sizeof(textRow) * configuration.rows_number);
+        configuration.win_rows = configuration.rows_number;
+        for( int i = 0; i < configuration.rows_number; i ++ )
+            configuration.row[i].idx -= count;
+        trigramRowsDropped(count);
+    }
+    configuration.cursorY = configuration.cursorY > count ? configuration.cursorY - count : 0;
+    configuration.row_offset = configuration.row_offset > count ? configuration.row_offset - count : 0;
+    if( configuration.rope )
+        ropeLoadWindow(configuration.cursorY);
+    clampCursorX();
+    configuration.line_offsets.valid = 0;
+    undoForget();
+    journalDiscard(); // its records name rows by number too, replayed on the whole file they would hit the wrong ones
+    configuration.follow.dropped += count;
+}
+
+void followRead(long long deadline)
+{
+    /* appends what the file grew by since the last time, until the deadline, the rest is left for the next idle slice */
+    struct follow* follow = &configuration.follow;
+    follow->changed = 0;
+    loadRest(); // rows are only appended after the last one, and the offset is known once the file is loaded
+    int fd = open(configuration.filename, O_RDONLY);
+    struct stat st;
+    if( fd == -1 || fstat(fd, &st) == -1 )
+    {
+        if( fd != -1 )
+            close(fd);
+        return; // gone for now, a new file under the name will be watched by editorIdle()
+    }
+    if( st.st_ino != follow->inode )
+    {
+        if( follow->watch != -1 )
+            inotify_rm_watch(follow->fd, follow->watch);
+        follow->watch = inotify_add_watch(follow->fd, configuration.filename, LEAF_FOLLOW_EVENTS);
+        follow->inode = st.st_ino;
+        follow->offset = 0;
+        follow->open_line = 0;
+        journalDiscard(); // the document is the old file and the new one now, no file on disk to replay it on
+        setStatusMessage("%.40s was replaced, following the new file", configuration.filename);
+    }
+    else if( st.st_size < follow->offset )
+    {
+        if( configuration.rope ) // the mapping lost the text past the new end, the document can't go on from it
+        {
+            close(fd);
+            follow->on = 0;
+            follow->external = 1;
+            setStatusMessage("%.40s was truncated, stopped following: Ctrl-E reloads it", configuration.filename);
+            return;
+        }
+        follow->offset = 0;
+        follow->open_line = 0;
+        journalDiscard();
+        setStatusMessage("%.40s was truncated, following it from the start", configuration.filename);
+    }
+
+    int rows = configuration.rows_number;
+    int at_end = ( configuration.cursorY >= rows - 1 );
+    long long offset = follow->offset;
+    char* buffer = malloc(LEAF_FOLLOW_CHUNK);
+    ssize_t got;
+    while( ( got = pread(fd, buffer, LEAF_FOLLOW_CHUNK, follow->offset) ) > 0 )
+    {
+        followAppend(buffer, got);
+        follow->offset += got;
+        if( monotonicMs() >= deadline )
+        {
+            follow->changed = 1;
+            break;
+        }
+    }
+    free(buffer);
+    close(fd);
+    if( follow->offset != offset )
+        journalRestamp(); // otherwise the journal names the file as it was and recovery would throw the edits away
+
+    if( at_end ) // the cursor was following the end of the log, so it keeps doing that
+    {
+        configuration.cursorY += configuration.rows_number - rows;
+        clampCursorX();
+    }
+    if( follow->keep > 0 && configuration.rows_number > follow->keep + follow->keep / 8 )
+        dropHeadRows(configuration.rows_number - follow->keep);
+}
+
+int watchStart()
+{
+    /* watches the open file for changes, to follow it or to notice someone else changed it */
+    struct follow* follow = &configuration.follow;
+    if( follow->fd != -1 )
+        return 0;
+    if( configuration.filename == NULL )
+        return -1;
+    follow->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if( follow->fd == -1 )
+        return -1;
+    followWatch();
+    return 0;
+}
+
+void followStart()
+{
+    struct follow* follow = &configuration.follow;
+    if( configuration.filename == NULL )
+    {
+        setStatusMessage("Nothing to follow, the buffer has no file");
+        return;
+    }
+    if( configuration.compression != COMPRESSION_NONE )
+    {
+        setStatusMessage("Can't follow a compressed file, what it grows by is not text");
+        return;
+    }
+    if( watchStart() == -1 )
+    {
+        setStatusMessage("Can't follow the file: %s", strerror(errno));
+        return;
+    }
+    follow->on = 1;
+    follow->external = 0; // appending what the file grew by is what following does
+    follow->changed = 1; // whatever was appended since the file was loaded is read right away
+    setStatusMessage("Following %.40s, Ctrl-A stops", configuration.filename);
+}
+
+void followStop()
+{
+    struct follow* follow = &configuration.follow;
+    follow->on = 0;
+    follow->changed = 0;
+    setStatusMessage("Stopped following %.40s", configuration.filename);
+}
+
+void followToggle()
+{
+    if( configuration.follow.on )
+        followStop();
+    else
+        followStart();
+}
+
+/*** Reload ***/
+
+/*
+The inotify watch of follow mode is kept for every file opened in a terminal, following or not. When the file changes and we
+are not following it, externalCheck() compares it with the size, modification time and inode recorded when it was loaded or
+last saved ( our own saves update them, so they don't count ) and the status bar says so. Ctrl-E then reloads it.
+
+Reloading doesn't throw the rows away. The new file is read into memory and split into lines, every line and every row is
+hashed, and the two sequences are diffed ( Myers' O(ND) algorithm, after the common head and tail are cut off ): only the
+hunks that differ are changed, through the normal row functions. So the unchanged rows keep their render and highlight, the
+cursor moves with the text it was on, and the reload is one undo step: Ctrl-Z goes back to the buffer as it was before,
+unsaved edits included. A diff bigger than LEAF_RELOAD_MAX_DIFF lines replaces the whole middle part instead.
+
+In rope mode the text nobody edited is read from the mapping of the file, so there is nothing reliable to diff against: the
+file is opened again, the cursor stays on the same line number and the undo history is dropped.
+*/
+
+struct diffLine{
+    const char* s;
+    int len;
+    unsigned long long hash;
+};
+
+struct diffHunk{
+    int a_start, a_len;     // rows of the buffer being replaced
+    int b_start, b_len;     // by these lines of the file
+};
+
+int diffSame(const struct diffLine* a, const struct diffLine* b)
+{
+    return a->hash == b->hash && a->len == b->len && memcmp(a->s, b->s, a->len) == 0;
+}
+
+int diffLines(const struct diffLine* a, int n, const struct diffLine* b, int m, struct diffHunk** hunks)
+{
+    /*
+    Stores in *hunks what turns a[0..n) into b[0..m), from the last hunk to the first so they can be applied in that order
+    without moving the ones still to come, and returns how many there are. -1 if the difference is bigger than
+    LEAF_RELOAD_MAX_DIFF lines. trace keeps the furthest x of every diagonal for every d, to walk the path back: pass d only
+    reaches the d + 1 diagonals -d, -d + 2 ... d, so the passes are stored back to back ( pass d starts at d * ( d + 1 ) / 2,
+    diagonal k is its ( k + d ) / 2th entry ) and the array grows with d. A diff of D lines costs D * D / 2 ints, not a
+    square sized for the worst case.
+    */
+    int max = n + m < LEAF_RELOAD_MAX_DIFF ? n + m : LEAF_RELOAD_MAX_DIFF;
+    long long capacity = 0;
+    int* trace = NULL;
+    int found = -1;
+    for( int d = 0; d <= max && found == -1; d ++ )
+    {
+        long long need = (long long)( d + 1 ) * ( d + 2 ) / 2;
+        if( need > capacity )
+        {
+            capacity = capacity * 2 > need ? capacity * 2 : need;
+            trace = realloc(trace, sizeof(int) * capacity);
+        }
+        int* v = &trace[(long long)d * ( d + 1 ) / 2];
+        int* prev = &trace[(long long)( d - 1 ) * d / 2]; // prev[( k + d ) / 2 - 1] is diagonal k - 1 of pass d - 1, the next one k + 1
+        for( int k = -d; k <= d; k += 2 )
+        {
+            int at = ( k + d ) / 2;
+            int x;
+            if( d == 0 )
+                x = 0;
+            else if( k == -d || ( k != d && prev[at - 1] < prev[at] ) )
+                x = prev[at];           // down: a line of b is inserted
+            else
+                x = prev[at - 1] + 1;   // right: a line of a is deleted
+            int y = x - k;
+            while( x < n && y < m && diffSame(&a[x], &b[y]) )
+            {
+                x ++;
+                y ++;
+            }
+            v[at] = x;
+            if( x >= n && y >= m )
+            {
+                found = d;
+                break;
+            }
+        }
+    }
+    if( found == -1 )
+    {
+        free(trace);
+        return -1;
+    }
+
+    int count = 0;
+    *hunks = malloc(sizeof(struct diffHunk) * ( found + 1 ));
+    int x = n, y = m;
+    for( int d = found; d > 0; d -- )
+    {
+        int* prev = &trace[(long long)( d - 1 ) * d / 2];
+        int k = x - y;
+        int at = ( k + d ) / 2;
+        int down = ( k == -d || ( k != d && prev[at - 1] < prev[at] ) );
+        int px = down ? prev[at] : prev[at - 1];
+        int py = px - ( down ? k + 1 : k - 1 );
+        struct diffHunk edit = { px, !down, py, down };
+        struct diffHunk* last = count > 0 ? &(*hunks)[count - 1] : NULL;
+        if( last && edit.a_start + edit.a_len == last->a_start && edit.b_start + edit.b_len == last->b_start )
+        {
+            last->a_start = edit.a_start; // right in front of the hunk found before, they are one hunk
+            last->a_len += edit.a_len;
+            last->b_start = edit.b_start;
+            last->b_len += edit.b_len;
+        }
+        else
+            (*hunks)[count++] = edit;
+        x = px;
+        y = py;
+    }
+    free(trace);
+    return count;
+}
+
+int reloadMapRow(int y, const struct diffHunk* hunks, int count)
+{
+    /* where row y of the buffer is after the hunks ( last one first ) are applied */
+    for( int i = 0; i < count; i ++ )
+    {
+        const struct diffHunk* hunk = &hunks[i];
+        if( y >= hunk->a_start + hunk->a_len ) // after the closest hunk above it, it moves by what that one and all before it added
+            return y + ( hunk->b_start + hunk->b_len ) - ( hunk->a_start + hunk->a_len );
+        if( y >= hunk->a_start ) // inside a replaced hunk, it stays at the same distance from its start if there is room
+            return hunk->b_start + ( y - hunk->a_start < hunk->b_len ? y - hunk->a_start : ( hunk->b_len > 0 ? hunk->b_len - 1 : 0 ) );
+    }
+    return y;
+}
+
+void reloadApply(const struct diffHunk* hunk, const struct diffLine* b)
+{
+    /* the rows of the hunk are overwritten in place as far as they go, the rest is inserted or deleted */
+    int common = hunk->a_len < hunk->b_len ? hunk->a_len : hunk->b_len;
+    for( int i = 0; i < common; i ++ )
+    {
+        textRow* row = editorRow(hunk->a_start + i);
+        rowDeleteText(row, 0, row->size);
+        rowInsertText(editorRow(hunk->a_start + i), 0, b[hunk->b_start + i].s, b[hunk->b_start + i].len);
+    }
+    for( int i = common; i < hunk->a_len; i ++ )
+        deleteRow(hunk->a_start + common);
+    for( int i = common; i < hunk->b_len; i ++ )
+        insertRow(hunk->a_start + i, (char*)b[hunk->b_start + i].s, b[hunk->b_start + i].len);
+}
 
-    while( (length = getline(&line, &capacity, fp)) != -1 ) //This goes to the file line by line and saves in my rows array each line
+char* readWholeFile(const char* filename, size_t* length)
+{
+    FILE* fp = compressedOpen(open(filename, O_RDONLY), compressionOf(filename), "r");
+    if( fp == NULL )
+        return NULL;
+    size_t capacity = 1 << 16, len = 0;
+    char* data = malloc(capacity);
+    size_t got;
+    while( ( got = fread(data + len, 1, capacity - len, fp) ) > 0 )
     {
-    /*
-    First, we pass it a null line pointer and a linecap (line capacity) of 0. That makes it allocate new memory for 
-    the next line it reads, and set line to point to the memory, and set linecap to let you know how much memory it allocated. 
-    Its return value is the length of the line it read, or -1 if it’s at the end of the file and there are no more lines 
-    to read.
-    */
-        if( length != -1 )
+        len += got;
+        if( len == capacity )
         {
-            while( length > 0 && ( line[length - 1] == '\n' || line[length - 1] == '\r' ) )
-            {
-                length --;
-            }
-            insertRow(configuration.rows_number, line, length);
+            capacity *= 2;
+            data = realloc(data, capacity);
         }
     }
-    free(line);
+    int failed = ferror(fp);
     fclose(fp);
-    configuration.dirty = 0; //to reset the dirty flag
+    if( failed )
+    {
+        free(data);
+        return NULL;
+    }
+    *length = len;
+    return data;
 }
 
-void saveToFile()
+void reloadRope()
+{
+    int cursorY = configuration.cursorY;
+    int row_offset = configuration.row_offset;
+    if( access(configuration.filename, R_OK) == -1 ) // opening it again would fail, better keep what we have
+    {
+        setStatusMessage("Can't reload: %s", strerror(errno));
+        return;
+    }
+    gapCommit(); // the row being typed in is about to be freed
+    configuration.tab_cache.row = -1;
+    for( int i = 0; i < configuration.win_rows; i ++ )
+        freeRow(&configuration.row[i]);
+    configuration.win_rows = 0;
+    configuration.win_first = 0;
+    ropeClose(configuration.rope);
+    configuration.rope = NULL;
+    undoForget();
+    journalStart(); // the edits in it were made to the old file, they must not be replayed on the new one
+    char* filename = strdup(configuration.filename); // editorOpenRope() replaces it
+    editorOpenRope(filename);
+    free(filename);
+    configuration.cursorY = cursorY < configuration.rows_number ? cursorY : configuration.rows_number;
+    configuration.row_offset = row_offset;
+    clampCursorX();
+    setStatusMessage("Reloaded %.40s", configuration.filename);
+}
+
+void reloadFile()
 {
     if( configuration.filename == NULL )
+        return;
+    if( configuration.rope )
     {
-        configuration.filename = prompt("Save as: %s (ESC to cancel)", NULL);
-        if( configuration.filename == NULL )
-        {
-            setStatusMessage("Save aborted");
-            return;
-        }
-        selectSyntaxHighlight();
+        reloadRope();
+        configuration.follow.external = 0;
+        return;
+    }
+    long long trace_start = traceBegin();
+    loadRest();
+    gapCommit();
+    size_t length;
+    char* data = readWholeFile(configuration.filename, &length);
+    if( data == NULL )
+    {
+        setStatusMessage("Can't reload: %s", strerror(errno));
+        traceEnd("reloadFile", trace_start);
+        return;
     }
-    int length;
-    char* buffer = rowsToString(&length);
 
-    int fd = open(configuration.filename, O_RDWR | O_CREAT, 0644 );  //flags needed by the open function
-    if( fd != -1 )
+    int m = 0, capacity = 1024;
+    struct diffLine* b = malloc(sizeof(struct diffLine) * capacity);
+    for( size_t at = 0; at < length; )
     {
-        if( ftruncate(fd, length) != -1 ) // this sets the file size with the given dimension
+        char* newline = memchr(data + at, '\n', length - at);
+        size_t end = newline ? (size_t)( newline - data ) : length;
+        size_t len = end - at;
+        while( len > 0 && ( data[at + len - 1] == '\n' || data[at + len - 1] == '\r' ) ) // like editorOpen() does
+            len --;
+        if( m == capacity )
         {
-            if( write(fd, buffer, length) == length ) // we added 3 layers of protection in case something fails.
-            {
-                close(fd);
-                free(buffer);
-                configuration.dirty = 0; // we reset the flag if we save the file
-                setStatusMessage("%d bytes written to disk", length); // we send a mission acomplished message when we succesfully saved the file
-                return;
-            }
+            capacity *= 2;
+            b = realloc(b, sizeof(struct diffLine) * capacity);
         }
-        close(fd);
+        b[m].s = data + at;
+        b[m].len = len;
+        b[m].hash = fnvHash(LEAF_FNV_SEED, data + at, len);
+        m ++;
+        at = end + 1;
     }
-    free(buffer);
-    setStatusMessage("Saving failed. I/O error: %s", strerror(errno));
+    int n = configuration.rows_number;
+    struct diffLine* a = malloc(sizeof(struct diffLine) * ( n + 1 ));
+    for( int i = 0; i < n; i ++ )
+    {
+        textRow* row = &configuration.row[i];
+        a[i].s = row->chars;
+        a[i].len = row->size;
+        a[i].hash = fnvHash(LEAF_FNV_SEED, row->chars, row->size);
+    }
+
+    int head = 0, tail = 0;
+    while( head < n && head < m && diffSame(&a[head], &b[head]) )
+        head ++;
+    while( tail < n - head && tail < m - head && diffSame(&a[n - 1 - tail], &b[m - 1 - tail]) )
+        tail ++;
+    struct diffHunk* hunks = NULL;
+    int count = diffLines(&a[head], n - head - tail, &b[head], m - head - tail, &hunks);
+    if( count == -1 ) // too different to be worth it, the middle is replaced as one hunk
+    {
+        count = 1;
+        hunks = malloc(sizeof(struct diffHunk));
+        hunks[0] = (struct diffHunk){ 0, n - head - tail, 0, m - head - tail };
+    }
+    int changed = 0;
+    for( int i = 0; i < count; i ++ )
+    {
+        hunks[i].a_start += head;
+        hunks[i].b_start += head;
+        changed += hunks[i].a_len > hunks[i].b_len ? hunks[i].a_len : hunks[i].b_len;
+    }
+    int cursorY = reloadMapRow(configuration.cursorY, hunks, count);
+    int row_offset = reloadMapRow(configuration.row_offset, hunks, count);
+    free(a); // it points into the rows, which change now
+    configuration.undo.last = -1; // the reload must not coalesce into the last thing typed, it is an undo step of its own
+    configuration.undo.new_group = 1;
+    for( int i = 0; i < count; i ++ )
+        reloadApply(&hunks[i], b);
+    free(hunks);
+    free(b);
+    undoSaveSidecar(fnvHash(LEAF_FNV_SEED, data, length)); // the history goes on from the file as it is now
+    free(data);
+
+    configuration.cursorY = cursorY;
+    configuration.row_offset = row_offset;
+    clampCursorX();
+    configuration.dirty = 0; // the buffer is the file on disk now, and undoing the reload makes it dirty again
+    configuration.undo.saved = configuration.undo.base + configuration.undo.pos;
+    journalStart();
+    followMark(-1);
+    configuration.follow.external = 0;
+    setStatusMessage("Reloaded %.40s: %d lines changed, Ctrl-Z undoes the reload", configuration.filename, changed);
+    traceEnd("reloadFile", trace_start);
+}
+
+void externalCheck()
+{
+    /* the watched file changed and we are not following it: unless it is only our own save, the user gets to know */
+    struct follow* follow = &configuration.follow;
+    struct stat st;
+    follow->changed = 0;
+    if( configuration.filename == NULL || stat(configuration.filename, &st) == -1 )
+        return;
+    if( st.st_ino == follow->inode && st.st_size == follow->size &&
+        st.st_mtim.tv_sec == follow->mtime_sec && st.st_mtim.tv_nsec == follow->mtime_nsec )
+        return;
+    if( !follow->external )
+        setStatusMessage("%.40s changed on disk, Ctrl-E reloads it", configuration.filename);
+    follow->external = 1;
 }
 
 /*** find ***/
@@ -821,6 +4853,7 @@ void findCallback(char* query, int key )
     I’ll implement this feature using two static variables in our callback. last_match will contain the index of the row that the last match was on, or -1 if there was no last match. And direction will store the direction of the search: 1 for searching forward, and -1 for searching backward.
     */
 
+    long long trace_start = traceBegin();
     static int last_match = -1;
     static int direction = 1;
 
@@ -829,7 +4862,8 @@ void findCallback(char* query, int key )
 
     if( saved_hl )
     {//if there is something to restore, we do it (we change back the color of the previously found sequence from blue to white)
-        memcpy(configuration.row[saved_hl_line].highlight, saved_hl, configuration.row[saved_hl_line].rsize);
+        textRow* row = editorRow(saved_hl_line);
+        memcpy(row->highlight, saved_hl, row->rsize);
         free(saved_hl);
         saved_hl = NULL;
     }
@@ -838,6 +4872,7 @@ void findCallback(char* query, int key )
     {
         last_match = -1;
         direction = 1;
+        traceEnd("findCallback", trace_start);
         return;
     }
     else if( key == ARROW_LEFT || key == ARROW_UP )
@@ -848,6 +4883,13 @@ void findCallback(char* query, int key )
     {
         direction = 1;
     }
+    else if( key == CTRL_KEY('t') || key == CTRL_KEY('w') )
+    {
+        // the modes are toggled from inside the prompt, and the search starts again from the top with the new mode
+        configuration.search_flags ^= ( key == CTRL_KEY('t') ) ? SEARCH_IGNORE_CASE : SEARCH_WHOLE_WORD;
+        last_match = -1;
+        direction = 1;
+    }
     else
     {
         last_match = -1;
@@ -858,40 +4900,87 @@ void findCallback(char* query, int key )
         direction = 1;
     int current = last_match;
 
-    for( int i = 0; i < configuration.rows_number; i ++ )
+    struct searchPattern pattern;
+    compilePattern(&pattern, query, configuration.search_flags);
+
+    int* candidates = NULL;
+    int candidate_count = trigramCandidates(query, &candidates);
+    int next_candidate = 0;
+    if( candidate_count > 0 )
     {
-        current += direction;
-        if( current == -1 )
-            current = configuration.rows_number - 1;
-        else if( current == configuration.rows_number )
-            current = 0;
+        /*
+        The candidates are sorted, so i look for the first one after the last match in the search direction
+        and from there i walk the list ( wrapping around ) exactly like the linear search walks the rows.
+        */
+        int lo = lowerBound(candidates, candidate_count, current + 1);
+        next_candidate = ( direction == 1 ) ? lo : lo - 1;
+        if( direction == -1 && lo > 0 && candidates[lo - 1] == current )
+            next_candidate --;
+        next_candidate = ( next_candidate + candidate_count ) % candidate_count;
+    }
 
-        textRow* row = &configuration.row[current];
-        char* match = strstr(row->render, query);
-        if( match )
+    int found = -1;
+    int match = -1;
+    int steps = ( candidate_count >= 0 ) ? candidate_count : configuration.rows_number;
+    if( candidate_count < 0 && configuration.rope ) // a large file is searched straight in the rope, not row by row
+    {
+        found = ropeFindLine(&pattern, current, direction, &match);
+        steps = 0;
+    }
+    for( int i = 0; i < steps; i ++ )
+    {
+        if( candidate_count >= 0 )
+        {
+            current = candidates[next_candidate];
+            next_candidate = ( next_candidate + direction + candidate_count ) % candidate_count;
+        }
+        else
         {
-            last_match = current;
-            configuration.cursorY = current;
-            configuration.cursorX = CursorXToRenderXConverter(row, match - row->render);
-            configuration.row_offset = configuration.rows_number;
+            current += direction;
+            if( current == -1 )
+                current = configuration.rows_number - 1;
+            else if( current == configuration.rows_number )
+                current = 0;
+        }
 
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);//we load the things we will have to change
-            memcpy(saved_hl, row->highlight, row->rsize);
-            memset(&row->highlight[match - row->render], HL_MATCH, strlen(query));
-            break;  
+        textRow* row = editorRow(current);
+        match = patternSearch(&pattern, row->chars, row->size, 0); // we search the real text, the render is only needed to show the match
+        if( match != -1 )
+        {
+            found = current;
+            break;
         }
     }
+    if( found != -1 )
+    {
+        textRow* row = editorRow(found);
+        last_match = found;
+        configuration.cursorY = found;
+        configuration.cursorX = match;
+        configuration.row_offset = configuration.rows_number;
+
+        // the highlight is indexed by render columns, so both ends of the match are mapped through the tab table
+        int render_at = CursorXToRenderXConverter(row, match);
+        int render_end = CursorXToRenderXConverter(row, match + pattern.len);
+        saved_hl_line = found;
+        saved_hl = malloc(row->rsize);//we load the things we will have to change
+        memcpy(saved_hl, row->highlight, row->rsize);
+        memset(&row->highlight[render_at], HL_MATCH, render_end - render_at);
+    }
+    free(candidates);
+    traceEnd("findCallback", trace_start);
 }
 
 void find()
 {
+    loadRest(); // a match may be in the part of the file still on disk
+    gapCommit(); // the search reads every row as a plain string
     int saved_cursorX = configuration.cursorX;
     int saved_cursorY = configuration.cursorY;
     int saved_coloffset = configuration.column_offset;
     int saved_rowoffset = configuration.row_offset;
 
-    char* query = prompt("Search: %s (ESC or Enter to cancel | Arrows to navigate)", findCallback);
+    char* query = prompt("Search: %s (ESC or Enter to cancel | Arrows to navigate | Ctrl-T case | Ctrl-W word)", findCallback);
     if( query )
         free(query);
     else
@@ -903,6 +4992,255 @@ void find()
     }
 }
 
+int replaceAll( const char* query, const char* with, int first_row, int first_col, int rows )
+{
+    /*
+    Replaces every match in the next `rows` rows starting with first_row ( wrapping around the end of the file ), ignoring
+    the matches which start before first_col on the first row. All the matches are collected first and only then every
+    affected row is rebuilt once, so a replace-all touching 10k lines costs 10k row updates and not one per character.
+    Returns how many matches were replaced.
+    */
+    struct searchPattern pattern;
+    compilePattern(&pattern, query, configuration.search_flags);
+    int query_len = pattern.len;
+    int with_len = strlen(with);
+
+    int* candidates = NULL;
+    int candidate_count = trigramCandidates(query, &candidates); // only these rows can contain the query
+    int first_candidate = ( candidate_count > 0 ) ? lowerBound(candidates, candidate_count, first_row) : 0;
+
+    int capacity = 64, count = 0;
+    int* match_rows = malloc(sizeof(int) * capacity);
+    int* match_offsets = malloc(sizeof(int) * capacity);
+
+    int visits = ( candidate_count >= 0 ) ? candidate_count : rows;
+    for( int i = 0; i < visits; i ++ )
+    {
+        int at;
+        if( candidate_count >= 0 )
+        {
+            at = candidates[( first_candidate + i ) % candidate_count];
+            if( ( at - first_row + configuration.rows_number ) % configuration.rows_number >= rows )
+                continue; // outside of the range we were asked to replace in
+        }
+        else
+        {
+            at = ( first_row + i ) % configuration.rows_number;
+        }
+
+        textRow* row = editorRow(at);
+        int col = ( at == first_row ) ? first_col : 0;
+        int match;
+        while( col <= row->size && ( match = patternSearch(&pattern, row->chars, row->size, col) ) != -1 )
+        {
+            if( count == capacity )
+            {
+                capacity *= 2;
+                match_rows = realloc(match_rows, sizeof(int) * capacity);
+                match_offsets = realloc(match_offsets, sizeof(int) * capacity);
+            }
+            match_rows[count] = at;
+            match_offsets[count] = match;
+            count ++;
+            col = match + ( query_len ? query_len : 1 );
+        }
+    }
+    free(candidates);
+
+    for( int i = 0; i < count; )
+    {
+        int j = i;
+        while( j < count && match_rows[j] == match_rows[i] ) // the matches of one row are next to each other
+            j ++;
+        rowReplaceMatches(editorRow(match_rows[i]), &match_offsets[i], j - i, query_len, with, with_len);
+        i = j;
+    }
+    free(match_rows);
+    free(match_offsets);
+    return count;
+}
+
+void replace()
+{
+    /*
+    The search term is read with the same incremental find prompt, so the user sees where the first match is. Then i ask for
+    the replacement and walk through the matches starting with the row the search stopped on ( wrapping around the end of
+    the file ): y replaces the match, n skips it, a replaces this one and all the remaining ones at once, anything else stops.
+    */
+    loadRest();
+    gapCommit(); // the matches are looked up in plain strings
+    int saved_cursorX = configuration.cursorX;
+    int saved_cursorY = configuration.cursorY;
+    int saved_coloffset = configuration.column_offset;
+    int saved_rowoffset = configuration.row_offset;
+
+    char* query = prompt("Replace: %s (ESC to cancel | Arrows to navigate | Ctrl-T case | Ctrl-W word)", findCallback);
+    char* with = query ? promptWith("Replace with: %s (ESC to cancel)", NULL, 1) : NULL;
+    if( with == NULL || configuration.rows_number == 0 )
+    {
+        configuration.cursorX = saved_cursorX;
+        configuration.cursorY = saved_cursorY;
+        configuration.row_offset = saved_rowoffset;
+        configuration.column_offset = saved_coloffset;
+        free(query);
+        free(with);
+        return;
+    }
+
+    struct searchPattern pattern;
+    compilePattern(&pattern, query, configuration.search_flags);
+    int query_len = pattern.len;
+    int with_len = strlen(with);
+    int first_row = configuration.cursorY < configuration.rows_number ? configuration.cursorY : 0;
+    int replaced = 0;
+    configuration.undo.last = -1; // nothing merges into the edit typed before Ctrl-R, the replacing is one undo step of its own
+    configuration.undo.new_group = 1;
+    int i = 0, col = 0;
+    while( i < configuration.rows_number )
+    {
+        int at = ( first_row + i ) % configuration.rows_number;
+        textRow* row = editorRow(at);
+        int match = ( col <= row->size ) ? patternSearch(&pattern, row->chars, row->size, col) : -1;
+        if( match == -1 )
+        {
+            i ++;
+            col = 0;
+            continue;
+        }
+
+        configuration.cursorY = at;
+        configuration.cursorX = match;
+        int render_at = CursorXToRenderXConverter(row, configuration.cursorX);
+        int render_len = CursorXToRenderXConverter(row, configuration.cursorX + query_len) - render_at;
+        unsigned char* saved_hl = malloc(row->rsize);
+        memcpy(saved_hl, row->highlight, row->rsize);
+        memset(&row->highlight[render_at], HL_MATCH, render_len);
+
+        setStatusMessage("Replace this match? (y)es (n)o (a)ll, any other key stops");
+        refreshScreen();
+        int key = editorReadKey();
+        row = editorRow(at); // drawing the screen may have moved the rope window
+        memcpy(row->highlight, saved_hl, row->rsize);
+        free(saved_hl);
+
+        if( key == 'y' )
+        {
+            rowReplaceMatches(row, &configuration.cursorX, 1, query_len, with, with_len);
+            replaced ++;
+            col = configuration.cursorX + with_len; // we don't want to look for matches inside the replacement
+        }
+        else if( key == 'n' )
+        {
+            col = configuration.cursorX + query_len;
+        }
+        else
+        {
+            if( key == 'a' )
+                replaced += replaceAll(query, with, at, configuration.cursorX, configuration.rows_number - i);
+            break;
+        }
+    }
+    setStatusMessage("Replaced %d occurrence%s", replaced, replaced == 1 ? "" : "s");
+    free(query);
+    free(with);
+}
+
+/*** goto ***/
+
+/*
+Ctrl-G asks for a line ( "1200000" ) or a byte offset ( "@734003200" ) and puts the cursor there directly, in the middle of
+the screen. The line is simply cursorY. A byte offset needs the line it falls into: a rope counts bytes and newlines in every
+node and answers in O(log n) ( ropeLineOf() ), in row mode lineOffsets caches the start of every row. The cache is filled
+lazily only as far as the offset asked for, and an edit only drops the rows after the edited one ( lineOffsetsChanged() ),
+so jumping around an unchanged file is a binary search.
+*/
+
+void lineOffsetsChanged(int row)
+{
+    struct lineOffsets* offsets = &configuration.line_offsets;
+    if( offsets->valid > row + 1 )
+        offsets->valid = row + 1; // the edited row itself still starts where it did
+}
+
+int lineOfOffset(long long offset)
+{
+    if( configuration.rope )
+        return ropeLineOf(configuration.rope, offset);
+    struct lineOffsets* offsets = &configuration.line_offsets;
+    if( offsets->capacity < configuration.rows_number + 1 )
+    {
+        offsets->capacity = configuration.rows_number + 1;
+        offsets->start = realloc(offsets->start, sizeof(long long) * offsets->capacity);
+    }
+    if( offsets->valid == 0 )
+    {
+        offsets->start[0] = 0;
+        offsets->valid = 1;
+    }
+    if( offsets->valid > configuration.rows_number + 1 ) // rows were deleted at the end without an edit of the ones before
+        offsets->valid = configuration.rows_number + 1;
+    while( offsets->valid <= configuration.rows_number && offsets->start[offsets->valid - 1] <= offset )
+    {
+        offsets->start[offsets->valid] = offsets->start[offsets->valid - 1] + configuration.row[offsets->valid - 1].size + 1;
+        offsets->valid ++;
+    }
+    int lo = 0, hi = offsets->valid - 1; // the last row which starts at or before offset
+    while( lo < hi )
+    {
+        int mid = ( lo + hi + 1 ) / 2;
+        if( offsets->start[mid] <= offset )
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+long long lineStartOffset(int line)
+{
+    /* only called right after lineOfOffset() found line, so in row mode its offset is in the cache */
+    if( configuration.rope )
+        return ropeLineStart(configuration.rope, line);
+    return configuration.line_offsets.start[line];
+}
+
+void gotoPosition(int line, int col)
+{
+    if( line > configuration.rows_number )
+        line = configuration.rows_number;
+    if( line < 0 )
+        line = 0;
+    configuration.cursorY = line;
+    configuration.cursorX = col;
+    clampCursorX();
+    configuration.row_offset = line - configuration.screenrows / 2; // editorScroll() keeps it, the target ends up centered
+    if( configuration.row_offset < 0 )
+        configuration.row_offset = 0;
+}
+
+void gotoPrompt()
+{
+    char* answer = prompt("Go to line, or @byte offset: %s (ESC to cancel)", NULL);
+    if( answer == NULL )
+        return;
+    loadRest(); // the line may be in the part of the file still on disk
+    gapCommit();
+    char* end;
+    int is_offset = ( answer[0] == '@' );
+    long long value = strtoll(answer + is_offset, &end, 10);
+    if( end == answer + is_offset || *end != '\0' || value < 0 )
+        setStatusMessage("Not a line or @offset: %s", answer);
+    else if( is_offset )
+    {
+        int line = lineOfOffset(value);
+        long long col = value - lineStartOffset(line);
+        gotoPosition(line, col > INT_MAX ? INT_MAX : col);
+    }
+    else
+        gotoPosition(value > INT_MAX ? INT_MAX : (int)value - 1, 0); // lines are counted from 1 like in the status bar
+    free(answer);
+}
+
 /*** dynamic string and writing buffer ***/
 
 struct appendBuffer{                                               // we use this to not call so many writes each time we refresh the screen 
@@ -957,9 +5295,16 @@ void drawStatusBar(struct appendBuffer* buffer)
         else
             dirty_msg = "(EXTREMLY DIRTY!!!)";
     }
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", 
-        configuration.filename ? configuration.filename : "[NO NAME]", configuration.rows_number, dirty_msg );//"prints" in the status char max 20 characters from the file name and the number of lines in the file
-    int len_line_number = snprintf(lineNumber, sizeof(lineNumber), "%s | %d/%d", 
+    char loading[24] = "";
+    if( configuration.loader.fp && configuration.loader.size > 0 ) // the rest of the file is still being read
+        snprintf(loading, sizeof(loading), " (loading %lld%%)", configuration.loader.bytes * 100 / configuration.loader.size);
+    else if( configuration.follow.external )
+        snprintf(loading, sizeof(loading), " (changed on disk)");
+    int len = snprintf(status, sizeof(status), "%.20s - %d lines%s %s", 
+        configuration.filename ? configuration.filename : "[NO NAME]", configuration.rows_number, loading, dirty_msg );//"prints" in the status char max 20 characters from the file name and the number of lines in the file
+    int len_line_number = snprintf(lineNumber, sizeof(lineNumber), "%s%s%s | %d/%d", 
+        ( configuration.search_flags & SEARCH_IGNORE_CASE ) ? "[Aa] " : "", // the search modes stay on until toggled again
+        ( configuration.search_flags & SEARCH_WHOLE_WORD ) ? "[word] " : "",
         configuration.syntax ? configuration.syntax->filetype : "no type", // say what filetype i have
         configuration.cursorY + 1, configuration.rows_number); // we use cursorY + 1 because it is 0 indexed
     
@@ -997,7 +5342,7 @@ void editorScroll()
 {
     configuration.renderX = 0;
     if( configuration.cursorY < configuration.rows_number )
-        configuration.renderX = CursorXToRenderXConverter(&configuration.row[configuration.cursorY], configuration.cursorX);
+        configuration.renderX = CursorXToRenderXConverter(editorRow(configuration.cursorY), configuration.cursorX);
 
     if( configuration.cursorY < configuration.row_offset )
     {
@@ -1085,14 +5430,15 @@ void editorDrawRows(struct appendBuffer* buffer)
             // BufferAdder(buffer, lineNumber, numberLength);
             
 
-            int len = configuration.row[file_row].rsize - configuration.column_offset;
+            textRow* row = editorRow(file_row);
+            int len = row->rsize - configuration.column_offset;
             if( len < 0 ) 
                 len = 0;
             if( len > configuration.screencols )
                 len = configuration.screencols;
 
-            char* c = &configuration.row[file_row].render[configuration.column_offset];
-            unsigned char* hl = &configuration.row[file_row].highlight[configuration.column_offset];
+            char* c = &row->render[configuration.column_offset];
+            unsigned char* hl = &row->highlight[configuration.column_offset];
             int currentColor = -1; //is used to not have to "feed" the buffer escape sequences after each character, only when a certain color changed
             
             for( int j = 0; j < len; j ++ )
@@ -1121,7 +5467,7 @@ void editorDrawRows(struct appendBuffer* buffer)
                     */
                     char sym = (c[j] <= 26 ) ? '@' + c[j] : '?';
                     BufferAdder(buffer, "\x1b[7m", 4);
-                    BufferAdder(buffer, &sym, 4);
+                    BufferAdder(buffer, &sym, 1);
                     BufferAdder(buffer, "\x1b[m", 3);
                     if( currentColor != -1 )
                     {
@@ -1162,6 +5508,13 @@ void editorDrawRows(struct appendBuffer* buffer)
 
 void refreshScreen()
 {
+    long long trace_start = traceBegin();
+    struct latencyStats* latency = &configuration.latency;
+    long long start = monotonicUs();
+    long long highlight_before = latency->highlight_us; // what highlighting the edit cost, the rest is the frame's
+    if( latency->key_us )
+        latencyRecord(LATENCY_EDIT, start - latency->key_us - highlight_before);
+
     struct appendBuffer buffer = aBuf_init;
     editorScroll();
     hideCursor(&buffer);
@@ -1174,8 +5527,22 @@ void refreshScreen()
     reinitializeCursor(&buffer);
     showCursor(&buffer);
 
-    write(STDOUT_FILENO, buffer.seq, buffer.len);
+    long long built = monotonicUs();
+    configuration.frame_bytes = buffer.len;
+    screenWrite(buffer.seq, buffer.len);
     BufferFree(&buffer);
+
+    long long end = monotonicUs();
+    latencyRecord(LATENCY_FRAME, built - start - ( latency->highlight_us - highlight_before ));
+    latencyRecord(LATENCY_WRITE, end - built);
+    if( latency->key_us ) // the first frame would count highlighting the whole file as it was loaded
+    {
+        latencyRecord(LATENCY_HIGHLIGHT, latency->highlight_us);
+        latencyRecord(LATENCY_TOTAL, end - latency->key_us);
+    }
+    latency->key_us = 0;
+    latency->highlight_us = 0;
+    traceEnd("refreshScreen", trace_start);
 }
 
 void setStatusMessage(const char* format, ... )
@@ -1187,9 +5554,113 @@ void setStatusMessage(const char* format, ... )
     configuration.statusmsg_time = time(NULL);
 }
 
+/*** Memory accounting ***/
+
+/*
+memoryAccount() adds up what every part of the editor holds on the heap, from the sizes the parts already keep ( block
+classes, capacities ), nothing is tracked on the side. It walks the materialized rows and the rope, so it is meant for a
+report now and then, not for every frame. Ctrl-B shows the sum in the status bar, leaf --memory file and the memory command
+of a headless script print the whole table.
+*/
+
+const char* memory_kind_names[MEMORY_KINDS] = { "row structs", "row chars", "render+highlight", "arena slack", "undo log",
+    "journal", "search index", "rope", "caches", "frame", "instrumentation" };
+
+long long ropeMemory(void* node, int is_leaf)
+{
+    if( is_leaf )
+        return sizeof(struct ropeLeaf) + ((struct ropeLeaf*)node)->capacity; // a leaf still in the mapping owns no data
+    struct ropeNode* inner = node;
+    long long bytes = sizeof(struct ropeNode);
+    for( int i = 0; i < inner->count; i ++ )
+        bytes += ropeMemory(inner->child[i], inner->leaves);
+    return bytes;
+}
+
+void memoryAccount(struct memoryUsage* usage)
+{
+    memset(usage, 0, sizeof(*usage));
+    long long* bytes = usage->bytes;
+
+    bytes[MEMORY_ROW_STRUCTS] = (long long)configuration.win_rows * sizeof(textRow);
+    for( int i = 0; i < configuration.win_rows; i ++ )
+    {
+        textRow* row = &configuration.row[i];
+        if( row->chars )
+            bytes[MEMORY_CHARS] += rowBufSize(row->chars_class);
+        if( row->render )
+            bytes[MEMORY_CELLS] += rowBufSize(row->render_class);
+    }
+    struct rowArena* arena = &configuration.arena;
+    bytes[MEMORY_ARENA_SLACK] = arena->chunks * LEAF_ARENA_CHUNK + arena->big_bytes - bytes[MEMORY_CHARS] - bytes[MEMORY_CELLS];
+
+    bytes[MEMORY_UNDO] = configuration.undo.capacity;
+    bytes[MEMORY_JOURNAL] = configuration.journal.capacity;
+
+    struct trigramIndex* index = &configuration.trigram;
+    if( index->buckets )
+    {
+        bytes[MEMORY_INDEX] = LEAF_TRIGRAM_BUCKETS * sizeof(struct trigramPosting);
+        for( int i = 0; i < LEAF_TRIGRAM_BUCKETS; i ++ )
+            bytes[MEMORY_INDEX] += index->buckets[i].capacity * sizeof(unsigned int);
+    }
+    bytes[MEMORY_INDEX] += index->uid_capacity * sizeof(int) + index->row_uid_capacity * sizeof(unsigned int);
+
+    if( configuration.rope )
+    {
+        bytes[MEMORY_ROPE] = sizeof(struct rope) + ropeMemory(configuration.rope->root, 0);
+        usage->mapped = configuration.rope->map_len;
+    }
+
+    bytes[MEMORY_CACHES] = configuration.tab_cache.capacity * sizeof(struct tabStop) + sizeof(configuration.input) +
+        configuration.line_offsets.capacity * sizeof(long long);
+    bytes[MEMORY_FRAME] = configuration.frame_bytes + configuration.headless.sink_capacity;
+    bytes[MEMORY_INSTRUMENTATION] = sizeof(configuration.latency) + configuration.headless.len +
+        configuration.headless.event_count * sizeof(struct headlessEvent) +
+        ( configuration.trace.events ? LEAF_TRACE_EVENTS * sizeof(struct traceEvent) : 0 );
+
+    for( int kind = 0; kind < MEMORY_KINDS; kind ++ )
+        usage->total += bytes[kind];
+}
+
+void memoryReport()
+{
+    /* the whole table on stdout, for leaf --memory and headless scripts */
+    struct memoryUsage usage;
+    memoryAccount(&usage);
+    long long rows = configuration.win_rows;
+    long long row_bytes = usage.bytes[MEMORY_ROW_STRUCTS] + usage.bytes[MEMORY_CHARS] + usage.bytes[MEMORY_CELLS] +
+                          usage.bytes[MEMORY_ARENA_SLACK];
+    printf("%s: %d lines, %lld materialized\n", configuration.filename ? configuration.filename : "(empty)", configuration.rows_number, rows);
+    for( int kind = 0; kind < MEMORY_KINDS; kind ++ )
+        printf("  %-16s %14lld bytes\n", memory_kind_names[kind], usage.bytes[kind]);
+    printf("  %-16s %14lld bytes\n", "total", usage.total);
+    printf("  %-16s %14.1f bytes ( structs, chars, cells and slack )\n", "per row", rows ? (double)row_bytes / rows : 0.0);
+    if( usage.mapped )
+        printf("  %-16s %14lld bytes ( page cache, not counted )\n", "mapped file", usage.mapped);
+}
+
+void memoryShow()
+{
+    struct memoryUsage usage;
+    memoryAccount(&usage);
+    long long* bytes = usage.bytes;
+    double mb = 1024.0 * 1024.0;
+    long long rows = bytes[MEMORY_ROW_STRUCTS] + bytes[MEMORY_ARENA_SLACK];
+    long long undo = bytes[MEMORY_UNDO] + bytes[MEMORY_JOURNAL];
+    setStatusMessage("MEM %.1fMB: rows %.1f text %.1f cells %.1f undo %.1f index %.1f other %.1f", usage.total / mb,
+        rows / mb, bytes[MEMORY_CHARS] / mb, bytes[MEMORY_CELLS] / mb, undo / mb, bytes[MEMORY_INDEX] / mb,
+        ( usage.total - rows - bytes[MEMORY_CHARS] - bytes[MEMORY_CELLS] - undo - bytes[MEMORY_INDEX] ) / mb);
+}
+
 /*** input ***/
 
 char* prompt(char* prompt, void (*callback)(char*, int)) // it takes a callback function as an argument. I will call this function after each keypress, passing the current search query inputted by the user and the last key they pressed.
+{
+    return promptWith(prompt, callback, 0);
+}
+
+char* promptWith(char* prompt, void (*callback)(char*, int), int allow_empty) // allow_empty lets Enter accept an empty answer ( for example replacing with nothing )
 {
     size_t size = 128;
     char* buffer = malloc(size);
@@ -1205,7 +5676,7 @@ char* prompt(char* prompt, void (*callback)(char*, int)) // it takes a callback
         int c = editorReadKey();
         if( c == '\r' )
         {
-            if( length != 0 )
+            if( length != 0 || allow_empty )
             {
                 setStatusMessage("");
                 if( callback )
@@ -1242,9 +5713,17 @@ char* prompt(char* prompt, void (*callback)(char*, int)) // it takes a callback
     }
 }
 
+int lastCursorRow()
+{
+    /* the empty row after the last one only exists once the file is loaded, until then the next lines of the file come there */
+    if( configuration.loader.fp && configuration.rows_number > 0 )
+        return configuration.rows_number - 1;
+    return configuration.rows_number;
+}
+
 void moveCursor(int key)
 {
-    textRow* row = (configuration.cursorY >= configuration.rows_number ) ? NULL : &configuration.row[configuration.cursorY];
+    textRow* row = (configuration.cursorY >= configuration.rows_number ) ? NULL : editorRow(configuration.cursorY);
 
     switch(key)
     {
@@ -1254,7 +5733,7 @@ void moveCursor(int key)
             else if(configuration.cursorY > 0)
             {
                 configuration.cursorY --;
-                configuration.cursorX = configuration.row[configuration.cursorY].size;  // allows the user to press ← at the beginning of the line to move to the end of the previous line.
+                configuration.cursorX = editorRow(configuration.cursorY)->size;  // allows the user to press ← at the beginning of the line to move to the end of the previous line.
             }
             break;
         case ARROW_RIGHT:
@@ -1262,7 +5741,7 @@ void moveCursor(int key)
             {
                 configuration.cursorX ++;
             }
-            else if( row && configuration.cursorX == row->size )
+            else if( row && configuration.cursorX == row->size && configuration.cursorY < lastCursorRow() )
             {
                 configuration.cursorY ++;
                 configuration.cursorX = 0; // 0
@@ -1273,11 +5752,16 @@ void moveCursor(int key)
                 configuration.cursorY --;
             break;
         case ARROW_DOWN:
-            if( configuration.cursorY < configuration.rows_number )
+            if( configuration.cursorY < lastCursorRow() )
                 configuration.cursorY ++;
             break;
     }
-    row = (configuration.cursorY >= configuration.rows_number ) ? NULL : &configuration.row[configuration.cursorY];
+    clampCursorX();
+}
+
+void clampCursorX()
+{
+    textRow* row = (configuration.cursorY >= configuration.rows_number ) ? NULL : editorRow(configuration.cursorY);
     int row_length = row ? row->size : 0;                       // this section is used to correct the cursor positioning in case
     if( configuration.cursorX > row_length )                    // you go down from a long line to a short line. It snaps the curosr to the end
         configuration.cursorX = row_length;                     // of the line.
@@ -1289,6 +5773,8 @@ void editorProcessKeypress()
     //it maps keys combination to various editor functions 
     int char_read = editorReadKey();
     static int quit_times = LEAF_QUIT_TIMES;
+    static int reload_times = 1;
+    undoKeypress(configuration.key_waiting);
 
 
     switch(char_read)
@@ -1306,30 +5792,37 @@ void editorProcessKeypress()
             }
             write(STDOUT_FILENO, "\x1b[2J", 4);                    // Again clear the screen
             write(STDOUT_FILENO, "\x1b[H", 3);
+            journalDiscard();
             exit(0);
             break;
         case CTRL_KEY('s'):
-            saveToFile();
+            {
+                long long trace_start = traceBegin(); // saveToFile() returns from too many places to trace it inside
+                saveToFile();
+                traceEnd("saveToFile", trace_start);
+            }
             break;
         case PAGE_DOWN:
         case PAGE_UP:
             {
-                if( char_read == PAGE_UP ) //Now that i have scrolling, let’s make the Page Up and Page Down keys scroll up or down an entire page.
-                {
-                    configuration.cursorY = configuration.row_offset;
-                }
-                else if( char_read == PAGE_DOWN )
+                /*
+                Page Up and Page Down scroll a entire page: the cursor goes one screen past the top ( or bottom ) row of the screen.
+                That used to be screenrows single steps of moveCursor(), now the row is computed directly and only the row
+                the cursor lands on is looked at, so the column is no longer cut short by the lines it passed over.
+                */
+                if( char_read == PAGE_UP )
                 {
-                    configuration.cursorY = configuration.row_offset + configuration.screenrows - 1;
-                    if( configuration.cursorY > configuration.rows_number )
-                        configuration.cursorY = configuration.rows_number;
+                    configuration.cursorY = configuration.row_offset - configuration.screenrows;
+                    if( configuration.cursorY < 0 )
+                        configuration.cursorY = 0;
                 }
-                
-                int rows = configuration.screenrows;
-                while( rows -- )
+                else
                 {
-                    moveCursor( char_read == PAGE_UP ? ARROW_UP : ARROW_DOWN );
+                    configuration.cursorY = configuration.row_offset + 2 * configuration.screenrows - 1;
+                    if( configuration.cursorY > lastCursorRow() )
+                        configuration.cursorY = lastCursorRow();
                 }
+                clampCursorX();
             }
             break;
         case HOME_KEY:
@@ -1337,7 +5830,7 @@ void editorProcessKeypress()
             break;
         case END_KEY:
             if( configuration.cursorY < configuration.rows_number ) 
-                configuration.cursorX = configuration.row[configuration.cursorY].size; //the end key press will make the cursor go to the end of the current line
+                configuration.cursorX = editorRow(configuration.cursorY)->size; //the end key press will make the cursor go to the end of the current line
             break;
         case ARROW_DOWN:
         case ARROW_LEFT:
@@ -1350,6 +5843,48 @@ void editorProcessKeypress()
             find();
             break;
 
+        case CTRL_KEY('r'):
+            replace();
+            break;
+
+        case CTRL_KEY('g'):
+            gotoPrompt();
+            break;
+
+        case CTRL_KEY('a'): // Ctrl-T is taken by the search prompt
+            followToggle();
+            break;
+
+        case CTRL_KEY('e'):
+            if( configuration.rope && configuration.dirty && reload_times > 0 ) // a rope can't diff, its unsaved changes are lost
+            {
+                setStatusMessage("WARNING! Reloading a rope loses the unsaved changes. Press Ctrl-E again to reload.");
+                reload_times --;
+                return;
+            }
+            reloadFile();
+            break;
+
+        case CTRL_KEY('z'):
+            undoStep(0);
+            break;
+
+        case CTRL_KEY('y'):
+            undoStep(1);
+            break;
+
+        case CTRL_KEY('p'):
+            latencyShow();
+            break;
+
+        case CTRL_KEY('o'):
+            traceKey();
+            break;
+
+        case CTRL_KEY('b'):
+            memoryShow();
+            break;
+
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -1366,7 +5901,11 @@ void editorProcessKeypress()
             break;
     }
 
+    if( configuration.gap.row != -1 && configuration.gap.row != configuration.cursorY )
+        gapCommit(); // the cursor left the row we were typing in, so it becomes a plain string again
+
     quit_times = LEAF_QUIT_TIMES;
+    reload_times = 1;
 }
 
 /*** init ***/
@@ -1385,6 +5924,35 @@ void initEditor()
     configuration.statusmsg_time = 0;
     configuration.dirty = 0;
     configuration.syntax = NULL;    // no filetype for the current file
+    memset(&configuration.arena, 0, sizeof(configuration.arena));
+    memset(&configuration.trigram, 0, sizeof(configuration.trigram)); // the search index stays off until a big file is opened
+    configuration.search_flags = 0;
+    configuration.gap.row = -1;     // no row is split by a gap
+    memset(&configuration.tab_cache, 0, sizeof(configuration.tab_cache));
+    configuration.tab_cache.row = -1;
+    configuration.rope = NULL;
+    configuration.win_first = 0;
+    configuration.win_rows = 0;
+    memset(&configuration.undo, 0, sizeof(configuration.undo));
+    configuration.undo.last = -1;
+    configuration.undo.new_group = 1;
+    configuration.undo.synced = -1; // whatever sidecar the file has is rewritten, unless editorOpen() adopts it
+    configuration.key_waiting = 0;
+    configuration.input.head = configuration.input.tail = 0;
+    memset(&configuration.headless, 0, sizeof(configuration.headless));
+    memset(&configuration.latency, 0, sizeof(configuration.latency));
+    memset(&configuration.trace, 0, sizeof(configuration.trace));
+    configuration.frame_bytes = 0;
+    memset(&configuration.journal, 0, sizeof(configuration.journal));
+    configuration.journal.fd = -1;
+    memset(&configuration.follow, 0, sizeof(configuration.follow));
+    configuration.follow.fd = -1;
+    configuration.follow.watch = -1;
+    initFoldTables();
+}
+
+void initScreenSize()
+{
     if( getWindowSize(&configuration.screenrows, &configuration.screencols) == -1 )
         die("getWidnowSize");
     configuration.screenrows -=2 ; // we leave an empty line at the end for the status bar and another one for the message box
@@ -1393,15 +5961,93 @@ void initEditor()
 
 int main(int argc, char* argv[] )
 {
-    enableRawMode();
-    //we now want to be able to take input from the users keyboard
-    initEditor();   
-    if( argc >= 2 )
+    int arg = 1;
+    int use_rope = -1; // -1 until a flag decides, then it is left to the size of the file
+    int report = 0;
+    char* script = NULL;
+    char* trace = NULL;
+    int follow = 0;
+    int keep = 0;
+    for( ; arg < argc && !strncmp(argv[arg], "--", 2); arg ++ )
+    {
+        if( !strcmp(argv[arg], "--rope") ) // leaf --rope file keeps the document in a rope, meant for huge files
+            use_rope = 1;
+        else if( !strcmp(argv[arg], "--rows") ) // and --rows keeps one buffer per line even for a large file
+            use_rope = 0;
+        else if( !strcmp(argv[arg], "--memory") )
+            report = 1;
+        else if( !strcmp(argv[arg], "--headless") && arg + 1 < argc )
+            script = argv[++ arg];
+        else if( !strcmp(argv[arg], "--trace") && arg + 1 < argc )
+            trace = argv[++ arg];
+        else if( !strcmp(argv[arg], "--follow") )
+            follow = 1;
+        else if( !strcmp(argv[arg], "--keep") && arg + 1 < argc && atoi(argv[arg + 1]) > 0 )
+            keep = atoi(argv[++ arg]);
+        else
+            break; // a option we don't know, the usage is printed below
+    }
+    if( ( arg < argc && !strncmp(argv[arg], "--", 2) ) || ( keep && !follow ) ) // --keep only bounds a followed file
+    {
+        fprintf(stderr, "usage: leaf [--rope | --rows] [--memory] [--headless script] [--trace out.json] [--follow [--keep lines]] [filename]\n");
+        return 1;
+    }
+    initEditor();
+    configuration.follow.keep = keep;
+    configuration.journal.off = report || script; // neither of them is a real editing session
+    if( trace )
+        traceStart(trace);
+    if( script )
+    {
+        if( headlessLoad(script) == -1 )
+            return 1;
+        atexit(headlessReport);
+        configuration.screenrows = LEAF_HEADLESS_ROWS - 2;
+        configuration.screencols = LEAF_HEADLESS_COLS;
+        headlessPhaseStart(0); // opening the file is the first phase
+    }
+    else if( !report )
+    {
+        enableRawMode();
+        //we now want to be able to take input from the users keyboard
+        initScreenSize();
+        signal(SIGHUP, journalSignal);
+        signal(SIGTERM, journalSignal);
+    }
+    if( argc > arg )
+    {
+        struct stat st;
+        if( use_rope != 0 && compressionOf(argv[arg]) != COMPRESSION_NONE )
+        {
+            if( use_rope == 1 && !report )
+                setStatusMessage("A compressed file can't be mapped, it is opened in row mode");
+            use_rope = 0; // a rope maps the text, here it first has to be decompressed
+        }
+        if( use_rope == -1 && stat(argv[arg], &st) == 0 && st.st_size >= LEAF_LARGE_FILE_BYTES )
+        {
+            use_rope = 1; // reading, rendering and highlighting every line of a file this big takes seconds and gigabytes
+            if( !report )
+                setStatusMessage("Large file: only the lines around the cursor are loaded and highlighted");
+        }
+        if( use_rope == 1 )
+            editorOpenRope(argv[arg]);
+        else
+            editorOpen(argv[arg]);
+        if( report || script )
+            loadRest(); // the report and the timing of the open phase are about the whole file
+        if( follow && !report )
+            followStart();
+        else if( !report && !script )
+            watchStart(); // to tell the user when someone else changes the file
+    }
+    if( report )
     {
-        editorOpen(argv[1]);
+        memoryReport();
+        return 0;
     }
 
-    setStatusMessage("HELP: Ctrl-X = quit | SAVE: Ctrl-S = save | FIND: Ctrl-F = find   ");
+    if( configuration.statusmsg[0] == '\0' ) // opening the file may have something to say, like recovered edits
+        setStatusMessage("HELP: ^X quit | ^S save | ^F find | ^R replace | ^G goto | ^Z undo | ^Y redo");
 
     while(1)                                            //we changed such that the terminal is not waiting for some input
     {